@@ -0,0 +1,624 @@
+#include <iostream>
+#include <cstdlib>
+#include <ctime>
+#include <cstdio>
+#include <new>
+#include "otml.h"
+
+static std::size_t allocatedBytes = 0;
+static std::size_t allocationCount = 0;
+
+void* operator new(std::size_t size)
+{
+    allocatedBytes += size;
+    allocationCount++;
+    void* p = malloc(size);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+#if __cplusplus >= 201703L
+// std::pmr::new_delete_resource() allocates through the aligned forms
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    allocatedBytes += size;
+    allocationCount++;
+    std::size_t align = static_cast<std::size_t>(alignment);
+    void* p = aligned_alloc(align, (size + align - 1) / align * align);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+    free(p);
+}
+#endif
+
+std::string generateDocument(int widgets)
+{
+    std::stringstream ss;
+    for(int i=0;i<widgets;++i) {
+        ss << "Widget\n";
+        ss << "  id: widget" << i << "\n";
+        ss << "  anchors.top: parent.top\n";
+        ss << "  anchors.left: parent.left\n";
+        ss << "  margin.top: " << i % 10 << "\n";
+        ss << "  size: 16 16\n";
+        ss << "  UIWidget\n";
+        ss << "    image: /core_styles/icons/settings.png\n";
+        ss << "    phantom: true\n";
+    }
+    return ss.str();
+}
+
+std::string generateDeepDocument(int blocks, int depth)
+{
+    std::stringstream ss;
+    for(int i=0;i<blocks;++i) {
+        for(int d=0;d<depth;++d)
+            ss << std::string(d*2, ' ') << "level" << d << "\n";
+        ss << std::string(depth*2, ' ') << "leaf: " << i << "\n";
+    }
+    return ss.str();
+}
+
+std::string generateGroupedDocument(int groups, int widgets)
+{
+    std::stringstream ss;
+    std::string group = generateDocument(widgets);
+    boost::replace_all(group, "\n", "\n  ");
+    for(int i=0;i<groups;++i)
+        ss << "group" << i << "\n  " << group.substr(0, group.length() - 2);
+    return ss.str();
+}
+
+int countNodes(const OTMLNodePtr& node)
+{
+    int count = 1;
+    for(int i=0;i<node->size();++i)
+        count += countNodes(node->atIndex(i));
+    return count;
+}
+
+double elapsed(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+void benchNodeMemory(const std::string& data, bool trackSource)
+{
+    OTMLParseOptions options;
+    options.trackSource = trackSource;
+
+    std::size_t bytesBefore = allocatedBytes;
+    std::size_t countBefore = allocationCount;
+    std::stringstream in(data);
+    clock_t start = clock();
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml", options);
+    double secs = elapsed(start);
+    int nodes = countNodes(doc);
+
+    std::cout << "parsed " << nodes << " nodes in " << secs << "s"
+              << (trackSource ? "" : " (no source tracking)") << std::endl;
+    std::cout << "memory per node: " << (allocatedBytes - bytesBefore) / nodes << " bytes allocated, "
+              << (double)(allocationCount - countBefore) / nodes << " allocations" << std::endl;
+}
+
+void benchEmit(const std::string& data, bool caching)
+{
+    std::stringstream in(data);
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml");
+    doc->setEmitCaching(caching);
+
+    // emit repeatedly touching a single node in between, like periodic saves
+    std::size_t bytes = 0;
+    clock_t start = clock();
+    for(int i=0;i<20;++i) {
+        doc->atIndex(i % doc->size())->writeAt("margin.top", i);
+        bytes += doc->emit().length();
+    }
+    double secs = elapsed(start);
+
+    std::cout << "emitted " << bytes << " bytes in " << secs << "s"
+              << (caching ? " (emit caching)" : "") << std::endl;
+}
+
+#ifdef OTML_PARALLEL
+void benchParallel(const std::string& data)
+{
+    // a few hundred independent subtrees, clone() and addChild() are quadratic in same-tag siblings
+    std::stringstream in(data);
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml");
+    double cloneBase = 0, hashBase = 0;
+    for(int threads=1;threads<=8;threads*=2) {
+        OTMLTaskPool pool(threads);
+        clock_t start = clock();
+        timespec wallStart, wallEnd;
+        clock_gettime(CLOCK_MONOTONIC, &wallStart);
+        for(int i=0;i<5;++i)
+            OTMLParallel::clone(doc, pool, 256);
+        clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+        double cloneSecs = (wallEnd.tv_sec - wallStart.tv_sec) + (wallEnd.tv_nsec - wallStart.tv_nsec) / 1e9;
+        clock_gettime(CLOCK_MONOTONIC, &wallStart);
+        for(int i=0;i<5;++i)
+            OTMLParallel::hash(doc, pool, 256);
+        clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+        double hashSecs = (wallEnd.tv_sec - wallStart.tv_sec) + (wallEnd.tv_nsec - wallStart.tv_nsec) / 1e9;
+        if(threads == 1) {
+            cloneBase = cloneSecs;
+            hashBase = hashSecs;
+        }
+        std::cout << threads << " threads: clone " << cloneSecs << "s (" << cloneBase / cloneSecs << "x), hash "
+                  << hashSecs << "s (" << hashBase / hashSecs << "x), cpu " << elapsed(start) << "s" << std::endl;
+    }
+}
+#endif
+
+void benchColumns(int records)
+{
+    std::stringstream ss;
+    for(int i=0;i<records;++i)
+        ss << "-\n  id: " << i << "\n  name: item" << i % 100 << "\n  weight: " << i * 0.5 << "\n  stackable: " << (i % 2 ? "true" : "false") << "\n";
+    OTMLDocumentPtr doc = OTMLDocument::parse(ss, "items.otml");
+
+    clock_t start = clock();
+    double sum = 0;
+    for(int i=0;i<doc->size();++i) {
+        OTMLNodePtr item = doc->atIndex(i);
+        sum += item->valueAt<long>("id") + item->valueAt<double>("weight") +
+               item->valueAt<std::string>("name").length() + item->valueAt<bool>("stackable");
+    }
+    std::cout << "read " << doc->size() << " records with valueAt in " << elapsed(start) << "s" << std::endl;
+
+    start = clock();
+    OTMLColumns columns;
+    columns.addColumn("id", OTMLColumn::IntColumn);
+    columns.addColumn("name", OTMLColumn::StringColumn);
+    columns.addColumn("weight", OTMLColumn::DoubleColumn);
+    columns.addColumn("stackable", OTMLColumn::BoolColumn);
+    columns.extract(doc);
+    std::cout << "extracted " << columns.rows() << " records into columns in " << elapsed(start) << "s" << std::endl;
+
+    // repeated analytics over one field
+    start = clock();
+    for(int pass=0;pass<20;++pass) {
+        for(int i=0;i<doc->size();++i)
+            sum += doc->atIndex(i)->valueAt<double>("weight");
+    }
+    std::cout << "summed a field 20 times with valueAt in " << elapsed(start) << "s" << std::endl;
+
+    start = clock();
+    const std::vector<double>& weights = columns.column("weight").doubles();
+    for(int pass=0;pass<20;++pass) {
+        for(std::size_t i=0;i<weights.size();++i)
+            sum += weights[i];
+    }
+    std::cout << "summed a column 20 times in " << elapsed(start) << "s (" << sum << ")" << std::endl;
+}
+
+void benchPathView(const std::string& data)
+{
+    std::stringstream in(data);
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml");
+    int groups = doc->size();
+    int found = 0;
+
+    clock_t start = clock();
+    for(int i=0;i<100000;++i)
+        found += doc->at("group" + otml_util::safeCast<std::string>(i % groups))->at("Widget")->at("UIWidget")->valueAt<bool>("phantom");
+    std::cout << "looked up 100000 nested paths in " << elapsed(start) << "s" << std::endl;
+
+    start = clock();
+    OTMLPathView view(doc);
+    view.refresh();
+    std::cout << "indexed " << view.size() << " paths in " << elapsed(start) << "s" << std::endl;
+
+    start = clock();
+    for(int i=0;i<100000;++i)
+        found += view.valueAt<bool>("group" + otml_util::safeCast<std::string>(i % groups) + "/Widget/UIWidget/phantom");
+    std::cout << "looked up 100000 paths in the path view in " << elapsed(start) << "s" << std::endl;
+
+    start = clock();
+    for(int i=0;i<1000;++i) {
+        doc->atIndex(i % groups)->atIndex(0)->writeAt("margin.top", i);
+        found += view.valueAt<int>("group" + otml_util::safeCast<std::string>(i % groups) + "/Widget/margin.top");
+    }
+    std::cout << "modified and looked up 1000 times in " << elapsed(start) << "s" << std::endl;
+}
+
+void benchOverlay(const std::string& data)
+{
+    std::stringstream in(data);
+    OTMLDocumentPtr base = OTMLDocument::parse(in, "base.otml");
+    std::stringstream overrideIn(generateDocument(50));
+    OTMLDocumentPtr overrides = OTMLDocument::parse(overrideIn, "overrides.otml");
+
+    clock_t start = clock();
+    OTMLNodePtr merged = base->clone();
+    for(int i=0;i<overrides->size();++i)
+        merged->addChild(overrides->atIndex(i)->clone());
+    int found = merged->atIndex(0)->valueAt<int>("margin.top");
+    std::cout << "merged override layer in " << elapsed(start) << "s" << std::endl;
+
+    start = clock();
+    OTMLOverlayPtr overlay = OTMLOverlay::create();
+    overlay->addLayer(base);
+    overlay->addLayer(overrides);
+    for(int i=0;i<100;++i)
+        found += overlay->get("Widget")->valueAt<int>("margin.top");
+    std::cout << "stacked override layer and queried it 100 times in " << elapsed(start) << "s" << std::endl;
+}
+
+void benchShardedDocument(const std::string& data)
+{
+    std::stringstream in(data);
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml");
+    doc->save("bench_world.otml");
+    OTMLShardedDocument::save(doc, "bench_world_manifest.otml");
+    std::string last = "group" + otml_util::safeCast<std::string>(doc->size() - 1);
+
+    clock_t start = clock();
+    int found = OTMLDocument::parse("bench_world.otml")->at(last)->at("Widget")->valueAt<int>("margin.top");
+    std::cout << "parsed whole document for one group in " << elapsed(start) << "s" << std::endl;
+
+    start = clock();
+    OTMLShardedDocumentPtr sharded = OTMLShardedDocument::open("bench_world_manifest.otml");
+    found += sharded->at(last)->at("Widget")->valueAt<int>("margin.top");
+    std::cout << "opened " << sharded->shardCount() << " shards and loaded one group in " << elapsed(start) << "s" << std::endl;
+
+    std::remove("bench_world.otml");
+    std::remove("bench_world_manifest.otml");
+    for(int i=0;i<sharded->shardCount();++i)
+        std::remove(("bench_world_manifest." + otml_util::safeCast<std::string>(i) + ".otml").c_str());
+}
+
+void benchPatchLog(const std::string& data)
+{
+    std::stringstream in(data), replicaIn(data);
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml");
+    OTMLDocumentPtr replica = OTMLDocument::parse(replicaIn, "replica.otml");
+    int groups = doc->size();
+
+    clock_t start = clock();
+    for(int i=0;i<100000;++i)
+        doc->atIndex(i % groups)->atIndex(0)->writeAt("margin.top", i);
+    std::cout << "made 100000 edits in " << elapsed(start) << "s (unobserved)" << std::endl;
+
+    OTMLPatchLog log(doc);
+    start = clock();
+    for(int i=0;i<100000;++i)
+        doc->atIndex(i % groups)->atIndex(0)->writeAt("margin.top", i);
+    std::cout << "made 100000 edits in " << elapsed(start) << "s (recorded, "
+              << log.data().length() << " bytes of patch)" << std::endl;
+    log.take();
+
+    for(int i=0;i<100;++i)
+        doc->atIndex(i % groups)->atIndex(0)->writeAt("margin.top", -i);
+    start = clock();
+    std::string patch = log.take();
+    OTMLPatchLog::apply(replica, patch);
+    std::cout << "applied 100 edits in " << elapsed(start) << "s (" << patch.length() << " bytes)" << std::endl;
+
+    start = clock();
+    std::string full = doc->emit();
+    std::stringstream fullIn(full);
+    OTMLDocument::parse(fullIn, "replica.otml");
+    std::cout << "resent whole document in " << elapsed(start) << "s (" << full.length() << " bytes)" << std::endl;
+}
+
+class CountingObserver : public OTMLObserver {
+public:
+    CountingObserver() : deliveries(0), nodes(0) { }
+    void onChanges(const OTMLChangeSet& changes) { deliveries++; nodes += changes.size(); }
+    int deliveries;
+    int nodes;
+};
+
+void benchObservers(const std::string& data)
+{
+    std::stringstream in(data);
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml");
+    int groups = doc->size();
+    OTMLObservers observers(doc);
+    CountingObserver observer;
+
+    clock_t start = clock();
+    for(int i=0;i<100000;++i)
+        doc->atIndex(i % groups)->atIndex(0)->at("margin.top")->write(i);
+    std::cout << "made 100000 edits in " << elapsed(start) << "s (no observers)" << std::endl;
+
+    observers.subscribe(doc, &observer, true);
+    start = clock();
+    for(int i=0;i<100;++i) {
+        observers.beginBatch();
+        for(int j=0;j<1000;++j)
+            doc->atIndex(j % groups)->atIndex(0)->at("margin.top")->write(i + j);
+        observers.endBatch();
+    }
+    std::cout << "made 100000 edits in " << elapsed(start) << "s (batches of 1000, " << observer.deliveries
+              << " deliveries of " << observer.nodes / observer.deliveries << " nodes)" << std::endl;
+}
+
+void benchTransactions(const std::string& data)
+{
+    std::stringstream in(data);
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml");
+    int groups = doc->size();
+    OTMLPatchLog log(doc);
+
+    clock_t start = clock();
+    for(int i=0;i<100000;++i)
+        doc->atIndex(i % groups)->atIndex(0)->writeAt("margin.top", i);
+    std::cout << "made 100000 edits in " << elapsed(start) << "s (recorded, "
+              << log.take().length() << " bytes of patch)" << std::endl;
+
+    start = clock();
+    std::size_t bytes = 0;
+    for(int i=0;i<100;++i) {
+        doc->beginTransaction();
+        for(int j=0;j<1000;++j)
+            doc->atIndex(j % groups)->atIndex(0)->writeAt("margin.top", i + j);
+        doc->commitTransaction();
+        bytes += log.take().length();
+    }
+    std::cout << "made 100000 edits in " << elapsed(start) << "s (transactions of 1000, "
+              << bytes << " bytes of patch)" << std::endl;
+
+    start = clock();
+    for(int i=0;i<100;++i) {
+        doc->beginTransaction();
+        for(int j=0;j<1000;++j)
+            doc->atIndex(j % groups)->atIndex(0)->writeAt("margin.top", -j);
+        doc->rollbackTransaction();
+    }
+    std::cout << "rolled back 100000 edits in " << elapsed(start) << "s (" << log.data().length()
+              << " bytes of patch)" << std::endl;
+}
+
+std::string settingPath(int i)
+{
+    std::stringstream ss;
+    ss << "section" << i % 200 << "/group" << i / 200 % 25 << "/key" << i / 5000;
+    return ss.str();
+}
+
+void benchPathWrites(int count)
+{
+    std::vector<std::string> paths;
+    for(int i=0;i<count;++i)
+        paths.push_back(settingPath(i));
+
+    // what writing a deep setting took before, a lookup and a unique add per segment
+    OTMLDocumentPtr manual = OTMLDocument::create();
+    clock_t start = clock();
+    for(int i=0;i<count;++i) {
+        std::vector<std::string> tags;
+        boost::split(tags, paths[i], boost::is_any_of("/"));
+        OTMLNodePtr node = manual;
+        for(std::size_t t=0;t+1<tags.size();++t) {
+            OTMLNodePtr child = node->get(tags[t]);
+            if(!child) {
+                child = OTMLNode::create(tags[t], true);
+                node->addChild(child);
+            }
+            node = child;
+        }
+        node->writeAt(tags.back(), paths[i]);
+    }
+    std::cout << "wrote " << count << " paths in " << elapsed(start) << "s (get and addChild per segment)" << std::endl;
+
+    OTMLDocumentPtr doc = OTMLDocument::create();
+    start = clock();
+    for(int i=0;i<count;++i)
+        doc->writeAtPath(paths[i], paths[i]);
+    std::cout << "wrote " << count << " paths in " << elapsed(start) << "s (writeAtPath)" << std::endl;
+
+    OTMLDocumentPtr batch = OTMLDocument::create();
+    start = clock();
+    OTMLPathWriter writer(batch);
+    for(int i=0;i<count;++i)
+        writer.write(paths[i], paths[i]);
+    std::cout << "wrote " << count << " paths in " << elapsed(start) << "s (OTMLPathWriter"
+              << (batch->emit() == manual->emit() ? "" : ", different output") << ")" << std::endl;
+}
+
+// xorshift64, rand() does not cover all bit patterns of a double
+boost::uint64_t randomBits(boost::uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+template<typename T, typename Bits>
+void benchFloatValues(int count, const char* name)
+{
+    boost::uint64_t state = 88172645463325252ULL;
+    std::vector<T> values;
+    values.reserve(count);
+    while((int)values.size() < count) {
+        Bits bits = (Bits)randomBits(state);
+        T v;
+        memcpy(&v, &bits, sizeof(v));
+        if(v == v)
+            values.push_back(v);
+    }
+
+    std::size_t length = 0;
+    clock_t start = clock();
+    for(int i=0;i<count;++i) {
+        std::stringstream ss;
+        ss << values[i];
+        length += ss.str().length();
+    }
+    std::cout << "formatted " << count << " " << name << " values in " << elapsed(start) << "s (stringstream, "
+              << length / count << " chars each, lossy)" << std::endl;
+
+    length = 0;
+    start = clock();
+    for(int i=0;i<count;++i)
+        length += otml_util::safeCast<std::string>(values[i]).length();
+    std::cout << "formatted " << count << " " << name << " values in " << elapsed(start) << "s (shortest round-trip, "
+              << length / count << " chars each)" << std::endl;
+
+    OTMLNodePtr node = OTMLNode::create("value");
+    int mismatches = 0;
+    start = clock();
+    for(int i=0;i<count;++i) {
+        node->write(values[i]);
+        if(node->value<T>() != values[i])
+            mismatches++;
+    }
+    std::cout << "wrote and read back " << count << " " << name << " values in " << elapsed(start) << "s ("
+              << mismatches << " mismatches)" << std::endl;
+}
+
+#ifdef OTML_SHARED_MEMORY
+void benchSharedDocument(const std::string& data)
+{
+    std::stringstream in(data);
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml");
+    clock_t start = clock();
+    OTMLSharedDocument::publish(doc, "/otml_bench");
+    std::cout << "published shared document in " << elapsed(start) << "s" << std::endl;
+
+    start = clock();
+    int found = 0;
+    for(int i=0;i<100;++i) {
+        OTMLSharedDocumentPtr shared = OTMLSharedDocument::attach("/otml_bench");
+        found += shared->root().atIndex(i % doc->size()).valueAt<int>("margin.top");
+    }
+    std::cout << "attached to shared document 100 times in " << elapsed(start) << "s ("
+              << OTMLSharedDocument::attach("/otml_bench")->imageSize() << " bytes)" << std::endl;
+    OTMLSharedDocument::unpublish("/otml_bench");
+}
+#endif
+
+#ifdef OTML_USE_PMR
+void benchMemoryResource(const std::string& data)
+{
+    // one arena per document, released at once instead of node by node
+    std::vector<char> arena(data.length() * 16);
+    std::pmr::monotonic_buffer_resource resource(&arena[0], arena.size());
+    OTMLParseOptions options;
+    options.memoryResource = &resource;
+
+    std::size_t countBefore = allocationCount;
+    std::stringstream in(data);
+    clock_t start = clock();
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml", options);
+    double secs = elapsed(start);
+    int nodes = countNodes(doc);
+
+    std::cout << "parsed " << nodes << " nodes in " << secs << "s (monotonic resource), "
+              << (double)(allocationCount - countBefore) / nodes << " heap allocations per node" << std::endl;
+
+    start = clock();
+    doc.reset();
+    std::cout << "destroyed document in " << elapsed(start) << "s (monotonic resource)" << std::endl;
+}
+#endif
+
+void benchLineScan(const std::string& data, otml_util::ScanBlockFunction scanBlock, const char* name)
+{
+    std::vector<otml_util::LineInfo> lines;
+    std::size_t count = 0;
+    clock_t start = clock();
+    for(int i=0;i<20;++i) {
+        std::size_t pos = 0;
+        do {
+            lines.clear();
+            otml_util::scanLines(data.data(), pos, data.length(), lines, scanBlock);
+            count += lines.size();
+            pos = lines.back().end + 1;
+        } while(pos < data.length());
+    }
+    double secs = elapsed(start);
+
+    std::cout << "scanned " << count << " lines at " << (20.0 * data.length() / secs) / 1e9 << " GB/s (" << name << ")" << std::endl;
+}
+
+void benchUtf8Validation(const std::string& data)
+{
+    std::stringstream in(data);
+    OTMLParseOptions options;
+    options.validateUtf8 = true;
+    clock_t start = clock();
+    OTMLDocumentPtr doc = OTMLDocument::parse(in, "bench.otml", options);
+    std::cout << "parsed with UTF-8 validation in " << elapsed(start) << "s" << std::endl;
+
+    start = clock();
+    for(int i=0;i<20;++i)
+        otml_util::isValidUtf8(data.data(), data.length());
+    std::cout << "validated UTF-8 at " << (20.0 * data.length() / elapsed(start)) / 1e9 << " GB/s" << std::endl;
+
+    doc->setUtf8Validation(true);
+    start = clock();
+    std::size_t bytes = 0;
+    for(int i=0;i<20;++i)
+        bytes += doc->emit().length();
+    std::cout << "emitted " << bytes << " bytes in " << elapsed(start) << "s (UTF-8 validation)" << std::endl;
+}
+
+void benchDeepDedents(const std::string& data)
+{
+    clock_t start = clock();
+    for(int i=0;i<10;++i) {
+        std::stringstream in(data);
+        OTMLDocument::parse(in, "deep.otml");
+    }
+    std::cout << "parsed deep document 10 times in " << elapsed(start) << "s" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    int widgets = 2000;
+    if(argc > 1)
+        widgets = atoi(argv[1]);
+
+    std::cout << "sizeof(OTMLNode): " << sizeof(OTMLNode) << " bytes" << std::endl;
+
+    std::string data = generateDocument(widgets);
+    benchNodeMemory(data, true);
+    benchNodeMemory(data, false);
+    benchEmit(data, false);
+    benchEmit(data, true);
+    benchUtf8Validation(data);
+    benchDeepDedents(generateDeepDocument(widgets, 32));
+    benchOverlay(data);
+    benchColumns(widgets * 10);
+    benchPathView(generateGroupedDocument(widgets / 8, 32));
+    benchShardedDocument(generateGroupedDocument(widgets / 8, 32));
+    benchPatchLog(generateGroupedDocument(widgets / 8, 32));
+    benchObservers(generateGroupedDocument(widgets / 8, 32));
+    benchTransactions(generateGroupedDocument(widgets / 8, 32));
+    benchPathWrites(widgets * 50);
+    benchFloatValues<double, boost::uint64_t>(widgets * 1000, "double");
+    benchFloatValues<float, boost::uint32_t>(widgets * 1000, "float");
+#ifdef OTML_PARALLEL
+    benchParallel(generateGroupedDocument(widgets / 8, 32));
+#endif
+#ifdef OTML_SHARED_MEMORY
+    benchSharedDocument(data);
+#endif
+#ifdef OTML_USE_PMR
+    benchMemoryResource(data);
+#endif
+
+    benchLineScan(data, otml_util::scanBlockScalar, "scalar");
+#ifdef OTML_SIMD_X86
+    benchLineScan(data, otml_util::scanBlockSSE2, "sse2");
+    if(__builtin_cpu_supports("avx2"))
+        benchLineScan(data, otml_util::scanBlockAVX2, "avx2");
+#endif
+    return 0;
+}
@@ -5,33 +5,128 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
 #include <exception>
 #include <memory>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
 #include <boost/algorithm/string.hpp>
 #include <boost/tokenizer.hpp>
+#include <boost/cstdint.hpp>
+
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#endif
+
+// with OTML_PARALLEL OTMLTaskPool and OTMLParallel spread whole tree operations over threads,
+// it needs -pthread on most platforms
+#ifdef OTML_PARALLEL
+#ifndef __GXX_EXPERIMENTAL_CXX0X__
+#error "OTML_PARALLEL requires C++11"
+#endif
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#endif
+
+#ifdef OTML_USE_PMR
+#if __cplusplus < 201703L
+#error "OTML_USE_PMR requires C++17"
+#endif
+#include <memory_resource>
+#endif
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <iterator>
+#include <utility>
+#define OTML_COROUTINES
+#endif
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+#ifdef __cpp_lib_to_chars
+#define OTML_TO_CHARS
+#endif
+
+// with OTML_SHARED_MEMORY OTMLSharedDocument can publish to and attach to POSIX shared memory
+// segments, older glibc needs -lrt for it
+#ifdef OTML_SHARED_MEMORY
+#if !defined(__unix__) && !defined(__APPLE__)
+#error "OTML_SHARED_MEMORY requires POSIX shared memory"
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define OTML_SIMD_X86
+#endif
 
 class OTMLNode;
 class OTMLDocument;
 class OTMLParser;
 class OTMLEmitter;
+class OTMLStreamReader;
+class OTMLStreamWriter;
+class OTMLSharedDocument;
+class OTMLOverlay;
+class OTMLShardedDocument;
+class OTMLPatchLog;
 
 #ifdef __GXX_EXPERIMENTAL_CXX0X__
 typedef std::shared_ptr<OTMLNode> OTMLNodePtr;
 typedef std::enable_shared_from_this<OTMLNode> OTMLNodeEnableSharedFromThis;
 typedef std::shared_ptr<OTMLDocument> OTMLDocumentPtr;
 typedef std::weak_ptr<OTMLNode> OTMLNodeWeakPtr;
+typedef std::shared_ptr<const std::string> OTMLStringPtr;
+typedef std::shared_ptr<OTMLSharedDocument> OTMLSharedDocumentPtr;
+typedef std::shared_ptr<OTMLOverlay> OTMLOverlayPtr;
+typedef std::shared_ptr<OTMLShardedDocument> OTMLShardedDocumentPtr;
 #else
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 typedef boost::shared_ptr<OTMLNode> OTMLNodePtr;
 typedef boost::enable_shared_from_this<OTMLNode> OTMLNodeEnableSharedFromThis;
 typedef boost::shared_ptr<OTMLDocument> OTMLDocumentPtr;
 typedef boost::weak_ptr<OTMLNode> OTMLNodeWeakPtr;
+typedef boost::shared_ptr<const std::string> OTMLStringPtr;
+typedef boost::shared_ptr<OTMLSharedDocument> OTMLSharedDocumentPtr;
+typedef boost::shared_ptr<OTMLOverlay> OTMLOverlayPtr;
+typedef boost::shared_ptr<OTMLShardedDocument> OTMLShardedDocumentPtr;
 #endif
 
 typedef std::vector<OTMLNodePtr> OTMLNodeList;
+typedef std::vector<OTMLOverlayPtr> OTMLOverlayList;
+
+// with OTML_USE_PMR node strings, child lists and the nodes themselves are
+// allocated from the memory resource of the document they belong to
+#ifdef OTML_USE_PMR
+typedef std::pmr::memory_resource OTMLMemoryResource;
+typedef std::pmr::string OTMLString;
+typedef std::pmr::vector<OTMLNodePtr> OTMLNodeStorage;
+#else
+typedef std::string OTMLString;
+typedef OTMLNodeList OTMLNodeStorage;
+#endif
 
 namespace otml_util {
     template<typename T, typename R>
@@ -96,26 +191,236 @@ namespace otml_util {
         return false;
     }
 
-    template<>
-    inline bool cast(const std::string& in, double& d) {
-        if(in.find_first_not_of("-0123456789.") != std::string::npos)
+    // decimal number with an optional exponent, or one of the spellings of non-finite values
+    inline bool isFloatText(const std::string& in) {
+        if(in == "inf" || in == "-inf" || in == "nan")
+            return true;
+        std::size_t e = in.find_first_of("eE");
+        std::string mantissa = in.substr(0, e);
+        if(mantissa.find_first_not_of("-0123456789.") != std::string::npos)
             return false;
-        std::size_t t = in.find_last_of('-');
+        std::size_t t = mantissa.find_last_of('-');
         if(t != std::string::npos &&  t != 0)
             return false;
-        t = in.find_first_of('.');
-        if(t != std::string::npos && (t == 0 || t == in.length()-1 || in.find_first_of('.', t+1) != std::string::npos))
+        t = mantissa.find_first_of('.');
+        if(t != std::string::npos && (t == 0 || t == mantissa.length()-1 || mantissa.find_first_of('.', t+1) != std::string::npos))
+            return false;
+        if(e == std::string::npos)
+            return true;
+        if(mantissa.find_first_of("0123456789") == std::string::npos)
+            return false;
+        std::size_t digits = e + 1;
+        if(digits < in.length() && (in[digits] == '+' || in[digits] == '-'))
+            digits++;
+        return digits < in.length() && in.find_first_not_of("0123456789", digits) == std::string::npos;
+    }
+
+    template<>
+    inline bool cast(const std::string& in, double& d) {
+        if(!isFloatText(in))
             return false;
-        d = atof(in.c_str());
+        d = strtod(in.c_str(), NULL);
         return true;
     }
 
+    template<>
+    inline bool cast(const std::string& in, float& f) {
+        // parsed directly, rounding through a double could land on the neighbouring float
+        if(isFloatText(in)) {
+            f = strtof(in.c_str(), NULL);
+            return true;
+        }
+        // floats used to be read by a stream, which also takes forms like ".5"
+        std::stringstream ss(in);
+        ss >> f;
+        return !!ss && ss.eof();
+    }
+
     template<>
     inline bool cast(const bool& in, std::string& out) {
         out = (in ? "true" : "false");
         return true;
     }
 
+#ifdef OTML_TO_CHARS
+    template<typename T>
+    inline void formatFloat(T v, std::string& out) {
+        if(v != v) {
+            out = "nan";
+            return;
+        }
+        char buffer[32];
+        std::to_chars_result result = std::to_chars(buffer, buffer + sizeof(buffer), v, std::chars_format::general);
+        out.assign(buffer, result.ptr);
+    }
+#else
+    inline bool readsBackAs(const char* text, double v) { return strtod(text, NULL) == v; }
+    inline bool readsBackAs(const char* text, float v) { return strtof(text, NULL) == v; }
+
+    // adds one unit in the last place to the significand of a number printed with %e
+    inline void incrementLastDigit(char* text) {
+        char* first = text[0] == '-' ? text + 1 : text;
+        char* exponent = strchr(text, 'e');
+        for(char* p = exponent - 1;p >= first;--p) {
+            if(*p == '.')
+                continue;
+            if(*p != '9') {
+                ++*p;
+                return;
+            }
+            *p = '0';
+        }
+        // 9.99e+05 rolled over to 0.00e+05, which is 1.00e+06
+        *first = '1';
+        // the callers' buffers have room for the exponent growing by one digit
+        char next[16];
+        snprintf(next, sizeof(next), "e%+03d", atoi(exponent + 1) + 1);
+        strcpy(exponent, next);
+    }
+
+    // rounds a number printed with %e to fewer significant digits, fails when the dropped digits
+    // are an exact half, as only the value itself tells which way that goes
+    inline bool roundText(const char* text, int digits, char* out) {
+        const char* exponent = strchr(text, 'e');
+        const char* p = text;
+        char* o = out;
+        if(*p == '-')
+            *o++ = *p++;
+        *o++ = *p++;
+        if(*p == '.') {
+            if(digits > 1)
+                *o++ = '.';
+            ++p;
+        }
+        for(int kept = 1;kept < digits;++kept)
+            *o++ = *p++;
+
+        bool up = false;
+        if(p < exponent && *p >= '5') {
+            const char* rest = p + 1;
+            while(rest < exponent && *rest == '0')
+                ++rest;
+            if(*p == '5' && rest == exponent)
+                return false;
+            up = true;
+        }
+        strcpy(o, exponent);
+        if(up)
+            incrementLastDigit(out);
+        return true;
+    }
+
+    // same text as std::to_chars with chars_format::general: the fewest significant digits that
+    // read back as v, plain notation for decimal exponents from -4 to 5 and scientific otherwise
+    template<typename T>
+    inline void formatFloat(T v, std::string& out) {
+        if(v != v) {
+            out = "nan";
+            return;
+        }
+        if(v - v != v - v) {
+            out = v < 0 ? "-inf" : "inf";
+            return;
+        }
+
+        // max_digits10, which C++98 does not have
+        const int maxDigits = (int)std::ceil(std::numeric_limits<T>::digits * 0.30103) + 1;
+        // rounded to fewer digits than digits10, a normal value's text only differs by trailing zeros,
+        // so the search starts there, subnormal values carry less precision and start from one digit
+        int digits = (std::fabs(v) >= std::numeric_limits<T>::min() || v == 0) ? std::numeric_limits<T>::digits10 : 1;
+        // values reading back as a power of two reach twice as far above it as below it,
+        // so when the nearest decimal is below and misses, the next one up may still hit
+        int binaryExponent;
+        bool powerOfTwo = std::frexp(v, &binaryExponent) == (v < 0 ? -0.5 : 0.5);
+
+        // printing dominates the cost, so it is done once and shorter candidates are rounded from the text
+        char full[32];
+        char buffer[32];
+        snprintf(full, sizeof(full), "%.*e", maxDigits - 1, (double)v);
+        const char* text = full;
+        for(;digits < maxDigits;++digits) {
+            if(!roundText(full, digits, buffer))
+                snprintf(buffer, sizeof(buffer), "%.*e", digits - 1, (double)v);
+            if(readsBackAs(buffer, v)) {
+                text = buffer;
+                break;
+            }
+            if(powerOfTwo && std::fabs(strtod(buffer, NULL)) < std::fabs(v)) {
+                incrementLastDigit(buffer);
+                if(readsBackAs(buffer, v)) {
+                    text = buffer;
+                    break;
+                }
+            }
+        }
+
+        // text holds [-]d.ddde[+-]xx
+        const char* p = text;
+        bool negative = *p == '-';
+        if(negative)
+            ++p;
+        std::string significand;
+        for(;*p != 'e';++p) {
+            if(*p != '.')
+                significand += *p;
+        }
+        int exponent = atoi(p + 1);
+        std::size_t last = significand.find_last_not_of('0');
+        significand.erase(last == std::string::npos ? 1 : last + 1);
+        int count = significand.length();
+
+        out.clear();
+        if(negative)
+            out += '-';
+        if(exponent < -4 || exponent >= 6) {
+            out += significand[0];
+            if(count > 1) {
+                out += '.';
+                out.append(significand, 1, std::string::npos);
+            }
+            snprintf(buffer, sizeof(buffer), "e%c%02d", exponent < 0 ? '-' : '+', std::abs(exponent));
+            out += buffer;
+        } else if(exponent < 0) {
+            out += "0.";
+            out.append(-exponent - 1, '0');
+            out += significand;
+        } else if(count <= exponent + 1) {
+            out += significand;
+            out.append(exponent + 1 - count, '0');
+        } else {
+            out.append(significand, 0, exponent + 1);
+            out += '.';
+            out.append(significand, exponent + 1, std::string::npos);
+        }
+    }
+#endif
+
+    // written with just enough digits to read back exactly
+    template<>
+    inline bool cast(const double& in, std::string& out) {
+        formatFloat(in, out);
+        return true;
+    }
+
+    template<>
+    inline bool cast(const float& in, std::string& out) {
+        formatFloat(in, out);
+        return true;
+    }
+
+#ifdef OTML_USE_PMR
+    // node values are pmr strings, forward them to the std::string conversions above
+    template<typename R>
+    bool cast(const std::pmr::string& in, R& out) {
+        return cast(std::string(in.data(), in.size()), out);
+    }
+
+    inline bool cast(const std::pmr::string& in, std::string& out) {
+        out.assign(in.data(), in.size());
+        return true;
+    }
+#endif
+
     class BadCast : public std::bad_cast {
     public:
         virtual ~BadCast() throw() { }
@@ -129,8 +434,430 @@ namespace otml_util {
             throw BadCast();
         return r;
     }
+
+    // 64 bit FNV-1a
+    inline boost::uint64_t hashBytes(boost::uint64_t h, const char* data, std::size_t n) {
+        for(std::size_t i=0;i<n;++i) {
+            h ^= (unsigned char)data[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    inline boost::uint64_t hashValue(boost::uint64_t h, boost::uint64_t v) {
+        for(int i=0;i<8;++i) {
+            h ^= (v >> (i*8)) & 0xff;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    // advanced by every OTMLPathView refresh that finds changes, markDirty() stamps the nodes
+    // it walks with it so each view can tell what changed since its own previous refresh,
+    // only nodes indexed since their last change are walked, so other trees are unaffected
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+    inline std::atomic<boost::uint64_t>& changeGeneration() {
+        static std::atomic<boost::uint64_t> generation(0);
+        return generation;
+    }
+#else
+    inline boost::uint64_t& changeGeneration() {
+        static boost::uint64_t generation = 0;
+        return generation;
+    }
+#endif
+
+    // tags joined with '/', none of them empty
+    inline bool isTagPath(const std::string& path) {
+        return !path.empty() && path[0] != '/' && path[path.length()-1] != '/' && path.find("//") == std::string::npos;
+    }
+
+    // strips the quotes of a quoted string value and resolves its escapes
+    inline std::string unquote(std::string value) {
+        if(value.length() < 2 || value[0] != '"' || value[value.length()-1] != '"')
+            return value;
+        // escapes are decoded in one pass, so an escaped backslash never starts another escape
+        std::string out;
+        out.reserve(value.length()-2);
+        std::size_t end = value.length()-1;
+        for(std::size_t i = 1; i < end; ++i) {
+            char c = value[i];
+            if(c == '\\' && i+1 < end) {
+                switch(value[i+1]) {
+                case '\\': case '"': case '\'': c = value[++i]; break;
+                case 't': c = '\t'; ++i; break;
+                case 'n': c = '\n'; ++i; break;
+                }
+            }
+            out += c;
+        }
+        return out;
+    }
+
+    inline bool fileEquals(const std::string& fileName, const std::string& data) {
+        std::ifstream fin(fileName.c_str(), std::ios::binary);
+        if(!fin.good())
+            return false;
+        fin.seekg(0, std::ios::end);
+        if(fin.tellg() != (std::streamoff)data.length())
+            return false;
+        fin.seekg(0, std::ios::beg);
+        char buffer[4096];
+        for(std::size_t pos = 0; pos < data.length(); pos += sizeof(buffer)) {
+            std::size_t count = std::min(sizeof(buffer), data.length() - pos);
+            if(!fin.read(buffer, count) || data.compare(pos, count, buffer, count) != 0)
+                return false;
+        }
+        return true;
+    }
+
+    // true for a missing or empty file too, nothing written after it can be glued to a previous line
+    inline bool endsWithNewline(const std::string& fileName) {
+        std::ifstream fin(fileName.c_str(), std::ios::binary);
+        if(!fin.good())
+            return true;
+        fin.seekg(0, std::ios::end);
+        if(fin.tellg() <= 0)
+            return true;
+        fin.seekg(-1, std::ios::end);
+        return fin.get() == '\n';
+    }
+
+    inline bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    inline int countTrailingZeros(boost::uint64_t v) {
+#ifdef __GNUC__
+        return __builtin_ctzll(v);
+#else
+        int n = 0;
+        while(!(v & 1)) {
+            v >>= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    struct LineInfo {
+        std::size_t begin;
+        std::size_t end;
+        std::size_t spaces;
+        std::size_t colon;
+    };
+
+    // classifies 64 bytes at once into bit masks of newlines, spaces and colons
+    typedef void (*ScanBlockFunction)(const char* p, boost::uint64_t& newlines, boost::uint64_t& spaces, boost::uint64_t& colons);
+
+    inline void scanBlockScalar(const char* p, boost::uint64_t& newlines, boost::uint64_t& spaces, boost::uint64_t& colons) {
+        newlines = spaces = colons = 0;
+        for(int i=0;i<64;++i) {
+            boost::uint64_t bit = (boost::uint64_t)1 << i;
+            if(p[i] == '\n')
+                newlines |= bit;
+            else if(p[i] == ' ')
+                spaces |= bit;
+            else if(p[i] == ':')
+                colons |= bit;
+        }
+    }
+
+#ifdef OTML_SIMD_X86
+    __attribute__((target("sse2")))
+    inline void scanBlockSSE2(const char* p, boost::uint64_t& newlines, boost::uint64_t& spaces, boost::uint64_t& colons) {
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i colon = _mm_set1_epi8(':');
+        newlines = spaces = colons = 0;
+        for(int i=0;i<4;++i) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + i*16));
+            newlines |= (boost::uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)) << (i*16);
+            spaces |= (boost::uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, space)) << (i*16);
+            colons |= (boost::uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, colon)) << (i*16);
+        }
+    }
+
+    __attribute__((target("avx2")))
+    inline void scanBlockAVX2(const char* p, boost::uint64_t& newlines, boost::uint64_t& spaces, boost::uint64_t& colons) {
+        const __m256i newline = _mm256_set1_epi8('\n');
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i colon = _mm256_set1_epi8(':');
+        __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+        newlines = (boost::uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newline)) |
+                   (boost::uint64_t)(boost::uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newline)) << 32;
+        spaces = (boost::uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, space)) |
+                 (boost::uint64_t)(boost::uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, space)) << 32;
+        colons = (boost::uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, colon)) |
+                 (boost::uint64_t)(boost::uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, colon)) << 32;
+    }
+#endif
+
+    enum SimdLevel {
+        SimdNone,
+        SimdSSE2,
+        SimdAVX2
+    };
+
+    inline SimdLevel detectSimdLevel() {
+#ifdef OTML_SIMD_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return SimdAVX2;
+        if(__builtin_cpu_supports("sse2"))
+            return SimdSSE2;
+#endif
+        return SimdNone;
+    }
+
+    inline SimdLevel simdLevel() {
+        static SimdLevel level = detectSimdLevel();
+        return level;
+    }
+
+    inline ScanBlockFunction selectScanBlockFunction() {
+#ifdef OTML_SIMD_X86
+        if(simdLevel() == SimdAVX2)
+            return scanBlockAVX2;
+        if(simdLevel() == SimdSSE2)
+            return scanBlockSSE2;
+#endif
+        return scanBlockScalar;
+    }
+
+    inline ScanBlockFunction scanBlockFunction() {
+        static ScanBlockFunction function = selectScanBlockFunction();
+        return function;
+    }
+
+    // returns the index of the first byte below limit when taken as signed, or n if there is none;
+    // a limit of 0 finds non ASCII bytes, a limit of 0x20 also finds control characters
+    typedef std::size_t (*FindBelowFunction)(const char* p, std::size_t n, signed char limit);
+
+    inline std::size_t findBelowScalar(const char* p, std::size_t n, signed char limit) {
+        for(std::size_t i=0;i<n;++i) {
+            if((signed char)p[i] < limit)
+                return i;
+        }
+        return n;
+    }
+
+#ifdef OTML_SIMD_X86
+    __attribute__((target("sse2")))
+    inline std::size_t findBelowSSE2(const char* p, std::size_t n, signed char limit) {
+        const __m128i l = _mm_set1_epi8(limit);
+        std::size_t i = 0;
+        for(; i + 16 <= n; i += 16) {
+            int mask = _mm_movemask_epi8(_mm_cmplt_epi8(_mm_loadu_si128((const __m128i*)(p + i)), l));
+            if(mask)
+                return i + countTrailingZeros(mask);
+        }
+        return i + findBelowScalar(p + i, n - i, limit);
+    }
+
+    __attribute__((target("avx2")))
+    inline std::size_t findBelowAVX2(const char* p, std::size_t n, signed char limit) {
+        const __m256i l = _mm256_set1_epi8(limit);
+        std::size_t i = 0;
+        for(; i + 32 <= n; i += 32) {
+            boost::uint32_t mask = _mm256_movemask_epi8(_mm256_cmpgt_epi8(l, _mm256_loadu_si256((const __m256i*)(p + i))));
+            if(mask)
+                return i + countTrailingZeros(mask);
+        }
+        return i + findBelowScalar(p + i, n - i, limit);
+    }
+#endif
+
+    inline FindBelowFunction selectFindBelowFunction() {
+#ifdef OTML_SIMD_X86
+        if(simdLevel() == SimdAVX2)
+            return findBelowAVX2;
+        if(simdLevel() == SimdSSE2)
+            return findBelowSSE2;
+#endif
+        return findBelowScalar;
+    }
+
+    inline std::size_t findBelow(const char* p, std::size_t n, signed char limit) {
+        static FindBelowFunction function = selectFindBelowFunction();
+        return function(p, n, limit);
+    }
+
+    // skips ASCII runs with findBelow and checks multibyte sequences one by one,
+    // rejecting overlong forms, surrogates and code points above U+10FFFF
+    inline bool isValidUtf8(const char* data, std::size_t n, std::size_t* errorPos = NULL) {
+        const unsigned char* p = (const unsigned char*)data;
+        std::size_t i = 0;
+        while(true) {
+            i += findBelow(data + i, n - i, 0);
+            if(i >= n)
+                return true;
+            unsigned char c = p[i];
+            std::size_t length;
+            unsigned char min = 0x80, max = 0xBF;
+            if(c >= 0xC2 && c <= 0xDF)
+                length = 2;
+            else if(c >= 0xE0 && c <= 0xEF) {
+                length = 3;
+                if(c == 0xE0)
+                    min = 0xA0;
+                else if(c == 0xED)
+                    max = 0x9F;
+            } else if(c >= 0xF0 && c <= 0xF4) {
+                length = 4;
+                if(c == 0xF0)
+                    min = 0x90;
+                else if(c == 0xF4)
+                    max = 0x8F;
+            } else
+                length = 0;
+            bool valid = length > 0 && i + length <= n && p[i+1] >= min && p[i+1] <= max;
+            for(std::size_t j = 2; valid && j < length; ++j)
+                valid = (p[i+j] & 0xC0) == 0x80;
+            if(!valid) {
+                if(errorPos)
+                    *errorPos = i;
+                return false;
+            }
+            i += length;
+        }
+    }
+
+    // appends to lines the lines starting at begin, stopping at the first line ending past
+    // 64 KiB of input; the last line is closed at size, after a trailing newline it is empty
+    inline void scanLines(const char* data, std::size_t begin, std::size_t size, std::vector<LineInfo>& lines,
+                          ScanBlockFunction scanBlock = scanBlockFunction()) {
+        const std::size_t npos = std::string::npos;
+        std::size_t limit = std::min(size, begin + 65536);
+        LineInfo line;
+        line.begin = begin;
+        line.spaces = line.colon = npos;
+
+        std::size_t block = begin;
+        char tail[64];
+        for(; block < size && (block < limit || lines.empty()); block += 64) {
+            const char* p = data + block;
+            std::size_t blockSize = std::min<std::size_t>(64, size - block);
+            if(blockSize < 64) {
+                memset(tail, 0, sizeof(tail));
+                memcpy(tail, p, blockSize);
+                p = tail;
+            }
+            boost::uint64_t newlines, spaces, colons;
+            scanBlock(p, newlines, spaces, colons);
+            boost::uint64_t valid = blockSize < 64 ? ((boost::uint64_t)1 << blockSize) - 1 : ~(boost::uint64_t)0;
+            boost::uint64_t nonSpaces = ~spaces & valid;
+
+            std::size_t offset = line.begin > block ? line.begin - block : 0;
+            while(offset < 64) {
+                boost::uint64_t from = ~(boost::uint64_t)0 << offset;
+                boost::uint64_t newline = newlines & from;
+                boost::uint64_t range = newline ? from & ((newline & (~newline + 1)) - 1) : from;
+                if(line.spaces == npos && (nonSpaces & range))
+                    line.spaces = block + countTrailingZeros(nonSpaces & range) - line.begin;
+                if(line.colon == npos && (colons & range))
+                    line.colon = block + countTrailingZeros(colons & range);
+                if(!newline)
+                    break;
+
+                line.end = block + countTrailingZeros(newline);
+                if(line.spaces == npos)
+                    line.spaces = line.end - line.begin;
+                lines.push_back(line);
+                line.begin = line.end + 1;
+                line.spaces = line.colon = npos;
+                offset = line.begin - block;
+            }
+        }
+        if(block >= size) {
+            line.end = size;
+            if(line.spaces == npos)
+                line.spaces = size - line.begin;
+            lines.push_back(line);
+        }
+    }
+};
+
+
+class OTMLProgressListener {
+public:
+    virtual ~OTMLProgressListener() { }
+    // called about every 64 KiB of input or output, totalBytes is 0 when not known yet
+    virtual void onProgress(std::size_t bytes, std::size_t totalBytes, std::size_t nodes) = 0;
+};
+
+struct OTMLChange {
+    enum Type {
+        TagChanged,
+        ValueChanged,
+        // unique or null
+        FlagsChanged,
+        ChildAdded,
+        ChildRemoved,
+        ChildrenCleared
+    };
+
+    Type type;
+    OTMLNodePtr node;
+    // position of the added or removed child in node
+    int index;
+    OTMLNodePtr child;
+};
+
+class OTMLChangeListener {
+public:
+    virtual ~OTMLChangeListener() { }
+    // called right after each change, so indexes are those of the tree as it is then
+    virtual void onChange(const OTMLChange& change) = 0;
+};
+
+// can be cancelled from another thread, running parses and emits using it then throw OTMLCancelledException
+class OTMLCancellationToken {
+public:
+    OTMLCancellationToken() : m_cancelled(false) { }
+    void cancel() { m_cancelled = true; }
+    bool isCancelled() const { return m_cancelled; }
+
+private:
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+    std::atomic<bool> m_cancelled;
+#else
+    volatile bool m_cancelled;
+#endif
 };
 
+struct OTMLParseOptions {
+    OTMLParseOptions() : trackSource(true), validateUtf8(false),
+        maxBytes(0), maxLineLength(0), maxDepth(0), maxNodes(0), maxListLength(0),
+        progressListener(NULL), cancellation(NULL)
+#ifdef OTML_USE_PMR
+        , memoryResource(NULL)
+#endif
+        { }
+
+    // when disabled parsed nodes carry no file/line information,
+    // errors raised later from them are reported without a location
+    bool trackSource;
+    // rejects input that is not well formed UTF-8
+    bool validateUtf8;
+
+    // limits for untrusted input, 0 means unlimited, exceeding one throws OTMLLimitException
+    std::size_t maxBytes;
+    std::size_t maxLineLength;
+    // number of nesting levels, the top level counts as one, so 1 allows only top level nodes
+    std::size_t maxDepth;
+    std::size_t maxNodes;
+    std::size_t maxListLength;
+
+    OTMLProgressListener* progressListener;
+    const OTMLCancellationToken* cancellation;
+
+#ifdef OTML_USE_PMR
+    // resource the parsed document is allocated from, NULL uses std::pmr::get_default_resource()
+    OTMLMemoryResource* memoryResource;
+#endif
+};
 
 class OTMLException : public std::exception {
 public:
@@ -145,21 +872,127 @@ protected:
     std::string m_what;
 };
 
+class OTMLLimitException : public OTMLException {
+public:
+    OTMLLimitException(const OTMLDocumentPtr& doc, const std::string& error, int line = -1) : OTMLException(doc, error, line) { }
+    virtual ~OTMLLimitException() throw() { };
+};
+
+class OTMLCancelledException : public OTMLException {
+public:
+    OTMLCancelledException(const OTMLNodePtr& node, const std::string& error) : OTMLException(node, error) { }
+    OTMLCancelledException(const OTMLDocumentPtr& doc, const std::string& error, int line = -1) : OTMLException(doc, error, line) { }
+    virtual ~OTMLCancelledException() throw() { };
+};
+
+#ifdef OTML_COROUTINES
+namespace otml_util {
+    // reads a shared buffer in place, keeping it alive
+    class BufferStreamBuf : public std::streambuf {
+    public:
+        explicit BufferStreamBuf(const OTMLStringPtr& buffer) : buffer(buffer) {
+            char* data = const_cast<char*>(buffer->data());
+            setg(data, data, data + buffer->length());
+        }
+
+    private:
+        OTMLStringPtr buffer;
+    };
+}
+
+// lazily computed sequence for range-for loops, each value is produced when the loop asks for it
+template<typename T>
+class OTMLGenerator {
+public:
+    struct promise_type {
+        const T* current = nullptr;
+        std::exception_ptr exception;
+
+        OTMLGenerator get_return_object() { return OTMLGenerator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const T& value) noexcept { current = std::addressof(value); return {}; }
+        void return_void() { }
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    class iterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef std::ptrdiff_t difference_type;
+        typedef T value_type;
+        typedef const T& reference;
+        typedef const T* pointer;
+
+        iterator() = default;
+        explicit iterator(std::coroutine_handle<promise_type> handle) : handle(handle) { resume(); }
+
+        reference operator*() const { return *handle.promise().current; }
+        pointer operator->() const { return handle.promise().current; }
+        iterator& operator++() { resume(); return *this; }
+        void operator++(int) { resume(); }
+        bool operator==(std::default_sentinel_t) const { return !handle || handle.done(); }
+
+    private:
+        void resume() {
+            handle.resume();
+            if(handle.done() && handle.promise().exception)
+                std::rethrow_exception(handle.promise().exception);
+        }
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    OTMLGenerator(OTMLGenerator&& other) noexcept : handle(std::exchange(other.handle, nullptr)) { }
+    OTMLGenerator& operator=(OTMLGenerator&& other) noexcept { std::swap(handle, other.handle); return *this; }
+    ~OTMLGenerator() { if(handle) handle.destroy(); }
+
+    // can only be iterated once
+    iterator begin() { return iterator(handle); }
+    std::default_sentinel_t end() const { return std::default_sentinel; }
+
+private:
+    explicit OTMLGenerator(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+    OTMLGenerator(const OTMLGenerator&) = delete;
+    OTMLGenerator& operator=(const OTMLGenerator&) = delete;
+
+    std::coroutine_handle<promise_type> handle;
+};
+#endif
+
+// data only some nodes need, allocated on demand to keep OTMLNode small
+struct OTMLNodeExtra {
+    OTMLNodeExtra() : emitDepth(-1), emitOffset(0), emitLength(0) { }
+
+    // text emitted for the subtree at emitDepth, kept by the children of the document only,
+    // the nodes below them keep where theirs starts in their parent's text and its length
+    std::string emitText;
+    int emitDepth;
+    std::size_t emitOffset;
+    std::size_t emitLength;
+};
+
 class OTMLNode : public OTMLNodeEnableSharedFromThis {
 public:
-    virtual ~OTMLNode() { }
+    virtual ~OTMLNode() { delete m_extra; }
 
     static OTMLNodePtr create(std::string tag = "", bool unique = false);
     static OTMLNodePtr create(std::string tag, std::string value);
+#ifdef OTML_USE_PMR
+    static OTMLNodePtr create(OTMLMemoryResource* resource, const std::string& tag = "", bool unique = false);
+    OTMLMemoryResource* memoryResource() const { return m_children.get_allocator().resource(); }
+#endif
 
-    std::string tag() const { return m_tag; }
+    std::string tag() const { return std::string(m_tag.data(), m_tag.size()); }
     int size() const { return m_children.size(); }
     OTMLNodePtr parent() const { return m_parent.lock(); }
-    std::string source() const { return m_source; }
-    std::string rawValue() const { return m_value; }
+    std::string source() const;
+    const OTMLStringPtr& sourceFile() const { return m_sourceFile; }
+    int sourceLine() const { return m_sourceLine; }
+    std::string rawValue() const { return std::string(m_value.data(), m_value.size()); }
 
-    bool isUnique() const { return m_unique; }
-    bool isNull() const { return m_null; }
+    bool isUnique() const { return hasFlag(UniqueFlag); }
+    bool isNull() const { return hasFlag(NullFlag); }
 
     bool hasTag() const { return !m_tag.empty(); }
     bool hasValue() const { return !m_value.empty(); }
@@ -167,12 +1000,19 @@ public:
     bool hasChildAt(const std::string& childTag) { return !!get(childTag); }
     bool hasChildAtIndex(int childIndex) { return !!getIndex(childIndex); }
 
-    void setTag(std::string tag) { m_tag = tag; }
-    void setValue(const std::string& value) { m_value = value; }
-    void setNull(bool null) { m_null = null; }
-    void setUnique(bool unique) { m_unique = unique; }
-    void setParent(const OTMLNodePtr& parent) { m_parent = parent; }
-    void setSource(const std::string& source) { m_source = source; }
+    void setTag(std::string tag) { touch(); m_tag.assign(tag.data(), tag.size()); markDirty(); notify(OTMLChange::TagChanged); }
+    void setValue(const std::string& value) {
+        touch();
+        m_value.assign(value.data(), value.size());
+        markDirty();
+        notify(OTMLChange::ValueChanged);
+    }
+    void setNull(bool null) { touch(); setFlag(NullFlag, null); markDirty(); notify(OTMLChange::FlagsChanged); }
+    void setUnique(bool unique) { touch(); setFlag(UniqueFlag, unique); markDirty(); notify(OTMLChange::FlagsChanged); }
+    // both the tree the node leaves and the one it joins see a change
+    void setParent(const OTMLNodePtr& parent) { markDirty(); m_parent = parent; markDirty(); }
+    void setSource(const std::string& source);
+    void setSource(const OTMLStringPtr& file, int line) { m_sourceFile = file; m_sourceLine = line; }
 
     OTMLNodePtr get(const std::string& childTag) const;
     OTMLNodePtr getIndex(int childIndex) const;
@@ -189,6 +1029,9 @@ public:
 
     OTMLNodeList children() const;
     OTMLNodePtr clone() const;
+    // structural hash of the subtree, tags, values, unique and null flags and child order count,
+    // source locations do not
+    boost::uint64_t hash() const;
 
     template<typename T>
     T value();
@@ -207,435 +1050,3744 @@ public:
     void writeAt(const std::string& childTag, const T& v);
     template<typename T>
     void writeIn(const T& v);
+    // writes v at a path of tags joined with '/', creating the missing nodes on the way as unique
+    // ones; an existing node at the path is written in place and keeps its children
+    template<typename T>
+    void writeAtPath(const std::string& path, const T& v);
 
     virtual std::string emit();
 
 protected:
-    OTMLNode() : m_unique(false), m_null(false) { }
+    enum Flag {
+        UniqueFlag = 1 << 0,
+        NullFlag = 1 << 1,
+        EmitCachedFlag = 1 << 2,
+        // children present when the document was last loaded or saved were removed or modified
+        ChildrenChangedFlag = 1 << 3,
+        // unchanged since its document was last loaded or saved
+        SavedFlag = 1 << 4,
+        // changes are reported to the listeners of the document at the root, if any
+        ObservedFlag = 1 << 5,
+        // the open transaction of the document has saved the node's previous state
+        TouchedFlag = 1 << 6,
+        // indexed by an OTMLPathView, which must learn about the node's next change
+        IndexedFlag = 1 << 7
+    };
 
-    OTMLNodeList m_children;
-    OTMLNodeWeakPtr m_parent;
-    std::string m_tag;
-    std::string m_value;
-    std::string m_source;
-    bool m_unique;
-    bool m_null;
-};
+    OTMLNode() : m_extra(NULL), m_sourceLine(0), m_flags(0), m_changeStamp(0) { }
+#ifdef OTML_USE_PMR
+    explicit OTMLNode(OTMLMemoryResource* resource) : m_children(resource), m_tag(resource), m_value(resource),
+        m_extra(NULL), m_sourceLine(0), m_flags(0), m_changeStamp(0) { }
 
-class OTMLDocument : public OTMLNode {
-public:
-    virtual ~OTMLDocument() { }
-    static OTMLDocumentPtr create();
-    static OTMLDocumentPtr parse(const std::string& fileName);
-    static OTMLDocumentPtr parse(std::istream& in, const std::string& source);
-    std::string emit();
-    bool save(const std::string& fileName);
+    // constructs T and its shared_ptr control block in memory taken from resource
+    template<typename T>
+    static std::shared_ptr<T> allocate(OTMLMemoryResource* resource);
+#endif
 
-private:
-    OTMLDocument() { }
+    // creates a node sharing this node's allocation strategy
+    OTMLNodePtr createChild(const std::string& tag = "", bool unique = false) const;
+    // first non null child with the tag, appended as a unique node when there is none
+    OTMLNodePtr resolveChild(const std::string& childTag);
+    // adds a child known not to clash with any sibling, skipping the scan addChild does
+    void appendChild(const OTMLNodePtr& newChild);
+    // copy of this node without its children
+    OTMLNodePtr cloneNode() const;
+    boost::uint64_t hashNode(const std::vector<boost::uint64_t>& childHashes) const;
+
+    OTMLNodeExtra* extra() { if(!m_extra) m_extra = new OTMLNodeExtra; return m_extra; }
+
+    bool hasFlag(Flag flag) const { return (m_flags & flag) != 0; }
+    void setFlag(Flag flag, bool on) { if(on) m_flags |= flag; else m_flags &= ~flag; }
+
+    void markDirty();
+    void markSaved();
+    void dropEmitCache();
+    // a subtree emitted under another parent does not line up with the cached text of the new one
+    void dropMovedEmitCache() {
+        if(hasFlag(EmitCachedFlag) || (m_extra && m_extra->emitDepth >= 0))
+            dropEmitCache();
+    }
+
+    // the only cost when nobody listens is the flag test
+    void notify(OTMLChange::Type type, int index = -1, const OTMLNodePtr& child = OTMLNodePtr()) {
+        if(hasFlag(ObservedFlag))
+            dispatchChange(type, index, child);
+    }
+    void dispatchChange(OTMLChange::Type type, int index, const OTMLNodePtr& child);
+    void setObserved(bool observed);
+    // called before a change, lets an open transaction save the node's state once
+    void touch() {
+        if(hasFlag(ObservedFlag) && !hasFlag(TouchedFlag))
+            dispatchTouch();
+    }
+    void dispatchTouch();
+    // called after a child is taken out, lets an open transaction follow it until commit
+    void detached(const OTMLNodePtr& child) {
+        if(hasFlag(TouchedFlag))
+            dispatchDetached(child);
+    }
+    void dispatchDetached(const OTMLNodePtr& child);
+    // document at the root when it has listeners or an open transaction
+    OTMLDocument* observingDocument();
+
+    // de-indents the lines [begin, end) of a parsed block into the value in one pass
+    void setBlockValue(const std::string& source, std::size_t begin, std::size_t end, int indent, char chomp, bool toEnd);
+
+    // members are ordered by size to avoid padding, the source is kept as a
+    // shared file name plus a line number instead of a formatted string per node
+    OTMLNodeStorage m_children;
+    OTMLNodeWeakPtr m_parent;
+    OTMLStringPtr m_sourceFile;
+    OTMLString m_tag;
+    OTMLString m_value;
+    OTMLNodeExtra* m_extra;
+    int m_sourceLine;
+    unsigned char m_flags;
+    // changeGeneration() when the node or its subtree last changed, never older than its children's
+    boost::uint64_t m_changeStamp;
+
+private:
+    OTMLNode(const OTMLNode&);
+    OTMLNode& operator=(const OTMLNode&);
+
+    friend class OTMLEmitter;
+    friend class OTMLParser;
+    friend class OTMLColumn;
+    friend class OTMLColumns;
+    friend class OTMLPathView;
+    friend class OTMLPathWriter;
+    friend class OTMLPatchLog;
+    friend class OTMLDocument;
+#ifdef OTML_PARALLEL
+    friend class OTMLParallel;
+#endif
+};
+
+class OTMLDocument : public OTMLNode {
+public:
+    virtual ~OTMLDocument() { }
+    static OTMLDocumentPtr create();
+#ifdef OTML_USE_PMR
+    static OTMLDocumentPtr create(OTMLMemoryResource* resource);
+#endif
+    static OTMLDocumentPtr parse(const std::string& fileName, const OTMLParseOptions& options = OTMLParseOptions());
+    static OTMLDocumentPtr parse(std::istream& in, const std::string& source, const OTMLParseOptions& options = OTMLParseOptions());
+#ifdef OTML_COROUTINES
+    // yields the top level nodes one at a time, only the lines of the node being parsed are kept
+    // in memory, so unique top level tags are not merged and limits other than maxBytes apply
+    // to each top level node, the stream must outlive the generator
+    static OTMLGenerator<OTMLNodePtr> stream(std::string fileName, OTMLParseOptions options = OTMLParseOptions());
+    static OTMLGenerator<OTMLNodePtr> stream(OTMLStringPtr buffer, std::string source, OTMLParseOptions options = OTMLParseOptions());
+    static OTMLGenerator<OTMLNodePtr> stream(std::istream& in, std::string source, OTMLParseOptions options = OTMLParseOptions());
+#endif
+    enum SaveMode {
+        SaveAlways,
+        SaveIfChanged,
+        SaveAppend
+    };
+
+    std::string emit();
+    // with SaveIfChanged the file is left untouched when it already holds the emitted content,
+    // with SaveAppend only the top level children added since the file was last loaded or saved
+    // are appended to it, falling back to a full write when children were removed or modified,
+    // written tells whether the file was actually modified
+    bool save(const std::string& fileName, SaveMode mode = SaveAlways, bool* written = NULL);
+
+    // rewrites a file grown by appends, dropping unique entries superseded by later ones
+    static bool compact(const std::string& fileName);
+
+    // keeps the emitted text of the document's children between emits, with where each subtree's
+    // lies in it, so saving a mostly unchanged document only re-serializes what was modified
+    void setEmitCaching(bool enabled);
+    bool isEmitCaching() const { return m_emitCaching; }
+
+    // makes emit()/save() fail on tags or values that are not well formed UTF-8
+    void setUtf8Validation(bool enabled) { m_utf8Validation = enabled; }
+    bool isUtf8Validating() const { return m_utf8Validation; }
+
+    // used by emit()/save(), the document does not own them
+    void setProgressListener(OTMLProgressListener* listener) { m_progressListener = listener; }
+    void setCancellationToken(const OTMLCancellationToken* cancellation) { m_cancellation = cancellation; }
+
+    // notified of every change made to the document's nodes, the document does not own them
+    void addChangeListener(OTMLChangeListener* listener);
+    void removeChangeListener(OTMLChangeListener* listener);
+
+    // changes made inside a transaction reach the change listeners on commit, coalesced per node,
+    // or are undone by rollback, including those made to nodes taken out of the document in
+    // between, changes made to nodes before they were first added are not, transactions do not nest
+    void beginTransaction();
+    void commitTransaction();
+    void rollbackTransaction();
+    bool inTransaction() const { return m_inTransaction; }
+
+private:
+    OTMLDocument() : m_savedChildren(-1), m_emitCaching(false), m_utf8Validation(false), m_inTransaction(false),
+        m_progressListener(NULL), m_cancellation(NULL) { }
+#ifdef OTML_USE_PMR
+    explicit OTMLDocument(OTMLMemoryResource* resource) : OTMLNode(resource), m_savedChildren(-1), m_emitCaching(false),
+        m_utf8Validation(false), m_inTransaction(false), m_progressListener(NULL), m_cancellation(NULL) { }
+#endif
+
+    // a node as it was before the open transaction first changed it
+    struct SavedNode {
+        OTMLNodePtr node;
+        std::string tag;
+        std::string value;
+        unsigned char flags;
+        OTMLNodeList children;
+    };
+
+    void saveNode(const OTMLNodePtr& node);
+    void saveDetached(const OTMLNodePtr& node);
+    void reportChanges(const std::vector<SavedNode>& saved, const std::set<const OTMLNode*>& detached);
+    void reportChanges(const SavedNode& saved, const std::set<const OTMLNode*>& detached, std::set<const OTMLNode*>& added);
+    void reportChange(OTMLChange::Type type, const OTMLNodePtr& node, int index = -1, const OTMLNodePtr& child = OTMLNodePtr());
+
+    static OTMLDocumentPtr allocateDocument(const OTMLParseOptions& options);
+
+    int emitFlags() const;
+
+    bool canAppendTo(const std::string& fileName) const;
+    void setSaved() { m_savedChildren = size(); setFlag(ChildrenChangedFlag, false); markSaved(); }
+
+    int m_savedChildren;
+    bool m_emitCaching;
+    bool m_utf8Validation;
+    bool m_inTransaction;
+    OTMLProgressListener* m_progressListener;
+    const OTMLCancellationToken* m_cancellation;
+    std::vector<OTMLChangeListener*> m_changeListeners;
+    std::vector<SavedNode> m_saved;
+    // children taken out of changed nodes, never reported as kept where they come back
+    std::set<const OTMLNode*> m_detached;
+
+    friend class OTMLNode;
+    friend class OTMLStreamReader;
+    friend class OTMLShardedDocument;
 };
 
 class OTMLParser {
 public:
-    OTMLParser(OTMLDocumentPtr doc, std::istream& in) :
-        currentDepth(0), currentLine(0),
-        doc(doc), currentParent(doc),
-        in(in) { }
+    OTMLParser(OTMLDocumentPtr doc, std::istream& in, const OTMLParseOptions& options = OTMLParseOptions(), int firstLine = 1) :
+        currentDepth(0), currentLine(firstLine - 1),
+        doc(doc), previousNode(NULL),
+        in(&in), pos(0), atEnd(false), lineIndex(0), nodeCount(0), options(options) { parents.push_back(doc.get()); }
+    OTMLParser(OTMLDocumentPtr doc, const OTMLStringPtr& buffer, const OTMLParseOptions& options = OTMLParseOptions(), int firstLine = 1) :
+        currentDepth(0), currentLine(firstLine - 1),
+        doc(doc), previousNode(NULL),
+        in(NULL), buffer(buffer), pos(0), atEnd(false), lineIndex(0), nodeCount(0), options(options) { parents.push_back(doc.get()); }
     void parse();
 
 private:
-    std::string getNextLine();
-    int getLineDepth(const std::string& line, bool multilining = false);
-    void parseLine(std::string line);
-    void parseNode(const std::string& data);
+    void readInput();
+    void reportProgress();
+    const otml_util::LineInfo& getNextLine();
+    int getLineDepth(const otml_util::LineInfo& line, bool multilining = false);
+    bool isBlankLine(const otml_util::LineInfo& line);
+    void parseLine(const otml_util::LineInfo& line);
+    void parseNode(const std::string& data, std::size_t dotsPos);
 
     int currentDepth;
     int currentLine;
     OTMLDocumentPtr doc;
-    OTMLNodePtr currentParent;
-    OTMLNodePtr previousNode;
+    // open nodes from the document down to the parent of the current depth, they are
+    // owned by the tree and only the last node of each depth can be replaced by a sibling
+    std::vector<OTMLNode*> parents;
+    OTMLNode* previousNode;
+    std::istream* in;
+    // the whole input is kept in memory, multiline values reference it until read
+    OTMLStringPtr buffer;
+    std::size_t pos;
+    bool atEnd;
+    // lines ahead of pos, scanned in bulk
+    std::vector<otml_util::LineInfo> lines;
+    std::size_t lineIndex;
+    std::size_t nodeCount;
+    OTMLParseOptions options;
+};
+
+// reads a stream of independent records separated by lines holding only "---",
+// keeping a single record in memory at a time
+class OTMLStreamReader {
+public:
+    OTMLStreamReader(std::istream& in, const std::string& source, const OTMLParseOptions& options = OTMLParseOptions()) :
+        in(in), source(source), options(options),
+        currentLine(0), position(0), recordStart(0) { }
+
+    // returns the next non empty record, or a null pointer at the end of the stream
+    OTMLDocumentPtr next();
+
+    // moves to a record boundary returned by split(), line numbers are counted from there
+    void seek(std::streamoff offset);
+    // offset of the record the next call to next() starts reading from
+    std::streamoff tell() const { return recordStart; }
+
+    // finds record boundaries splitting a seekable stream in roughly equal byte ranges,
+    // each range [offsets[i], offsets[i+1]) can then be processed by its own reader
+    static std::vector<std::streamoff> split(std::istream& in, int parts);
+    static bool isRecordMarker(const std::string& line);
+
+private:
     std::istream& in;
+    std::string source;
+    OTMLParseOptions options;
+    int currentLine;
+    std::streamoff position;
+    std::streamoff recordStart;
 };
 
-class OTMLEmitter {
+class OTMLStreamWriter {
 public:
-    static std::string emitNode(const OTMLNodePtr& node, int currentDepth = -1);
+    OTMLStreamWriter(std::ostream& out) : out(out) { }
+
+    // every record is preceded by a marker, so writers can append to existing streams
+    void write(const OTMLNodePtr& record);
+
+private:
+    std::ostream& out;
 };
 
-inline OTMLException::OTMLException(const OTMLNodePtr& node, const std::string& error) {
-    std::stringstream ss;
-    ss << "OTML error";
-    if(!node->source().empty())
-        ss << " in '" << node->source() << "'";
-    ss << ": " << error;
-    m_what = ss.str();
-}
+// flat, position independent layout of a published document, all references are offsets
+// so the image can be mapped at any address and shared read-only between processes
+struct OTMLSharedHeader {
+    char magic[8];
+    boost::uint32_t version;
+    boost::uint32_t nodeCount;
+    boost::uint64_t size;
+    boost::uint64_t nodesOffset;
+    boost::uint64_t stringsOffset;
+};
 
-inline OTMLException::OTMLException(const OTMLDocumentPtr& doc, const std::string& error, int line) {
-    std::stringstream ss;
-    ss << "OTML error";
-    if(doc && !doc->source().empty()) {
-        ss  << " in '" << doc->source() << "'";
-        if(line >= 0)
-            ss << " at line " << line;
+struct OTMLSharedNodeData {
+    enum Flag {
+        UniqueFlag = 1 << 0,
+        NullFlag = 1 << 1
+    };
+
+    // string offsets are relative to stringsOffset, children are stored contiguously
+    boost::uint64_t tag;
+    boost::uint64_t value;
+    boost::uint64_t sourceFile;
+    boost::uint32_t tagLength;
+    boost::uint32_t valueLength;
+    boost::uint32_t sourceFileLength;
+    boost::uint32_t firstChild;
+    boost::uint32_t childCount;
+    boost::int32_t sourceLine;
+    boost::uint32_t flags;
+    boost::uint32_t reserved;
+};
+
+// read-only view of a node inside a shared document, only valid while the document is alive
+class OTMLSharedNode {
+public:
+    OTMLSharedNode() : m_doc(NULL), m_node(NULL) { }
+
+    bool isValid() const { return m_node != NULL; }
+
+    std::string tag() const { return stringAt(m_node->tag, m_node->tagLength); }
+    int size() const { return m_node->childCount; }
+    std::string source() const;
+    int sourceLine() const { return m_node->sourceLine; }
+    std::string rawValue() const { return stringAt(m_node->value, m_node->valueLength); }
+
+    bool isUnique() const { return (m_node->flags & OTMLSharedNodeData::UniqueFlag) != 0; }
+    bool isNull() const { return (m_node->flags & OTMLSharedNodeData::NullFlag) != 0; }
+
+    bool hasTag() const { return m_node->tagLength > 0; }
+    bool hasValue() const { return m_node->valueLength > 0; }
+    bool hasChildren() const;
+    bool hasChildAt(const std::string& childTag) const { return get(childTag).isValid(); }
+    bool hasChildAtIndex(int childIndex) const { return getIndex(childIndex).isValid(); }
+
+    // return an invalid node when not found
+    OTMLSharedNode get(const std::string& childTag) const;
+    OTMLSharedNode getIndex(int childIndex) const;
+
+    OTMLSharedNode at(const std::string& childTag) const;
+    OTMLSharedNode atIndex(int childIndex) const;
+
+    template<typename T>
+    T value() const;
+    template<typename T>
+    T valueAt(const std::string& childTag) const { return at(childTag).value<T>(); }
+    template<typename T>
+    T valueAtIndex(int childIndex) const { return atIndex(childIndex).value<T>(); }
+    template<typename T>
+    T valueAt(const std::string& childTag, const T& def) const;
+    template<typename T>
+    T valueAtIndex(int childIndex, const T& def) const;
+
+    // copies the subtree into regular, modifiable nodes
+    OTMLNodePtr toNode() const;
+
+private:
+    OTMLSharedNode(const OTMLSharedDocument* doc, const OTMLSharedNodeData* node) : m_doc(doc), m_node(node) { }
+
+    const char* stringData(boost::uint64_t offset) const;
+    std::string stringAt(boost::uint64_t offset, boost::uint32_t length) const { return std::string(stringData(offset), length); }
+    bool tagEquals(const std::string& childTag) const;
+    OTMLNodePtr toNode(OTMLStringPtr& sourceFile, boost::uint64_t& sourceFileOffset) const;
+    OTMLException error(const std::string& error) const;
+
+    const OTMLSharedDocument* m_doc;
+    const OTMLSharedNodeData* m_node;
+
+    friend class OTMLSharedDocument;
+};
+
+// a document flattened into a single read-only memory block, that can be published
+// in a POSIX shared memory segment once and attached to from any number of processes
+class OTMLSharedDocument {
+public:
+    ~OTMLSharedDocument();
+
+    static std::string createImage(const OTMLNodePtr& doc);
+    // the image is not copied and must outlive the returned document,
+    // its header and every node record are checked, so a corrupted image throws
+    static OTMLSharedDocumentPtr fromImage(const char* data, std::size_t size);
+
+#ifdef OTML_SHARED_MEMORY
+    // replaces any segment with the same name, processes still attached to it keep seeing the old one
+    static void publish(const OTMLNodePtr& doc, const std::string& name);
+    static OTMLSharedDocumentPtr attach(const std::string& name);
+    static bool unpublish(const std::string& name);
+#endif
+
+    OTMLSharedNode root() const { return OTMLSharedNode(this, node(0)); }
+    OTMLDocumentPtr toDocument() const;
+    std::size_t imageSize() const { return m_size; }
+
+private:
+    OTMLSharedDocument(const char* data, std::size_t size, bool mapped);
+    OTMLSharedDocument(const OTMLSharedDocument&);
+    OTMLSharedDocument& operator=(const OTMLSharedDocument&);
+
+    static void checkImage(const char* data, std::size_t size, const std::string& name);
+
+    const OTMLSharedHeader* header() const { return reinterpret_cast<const OTMLSharedHeader*>(m_data); }
+    const OTMLSharedNodeData* node(boost::uint32_t index) const {
+        return reinterpret_cast<const OTMLSharedNodeData*>(m_data + header()->nodesOffset) + index;
+    }
+
+    const char* m_data;
+    std::size_t m_size;
+    bool m_mapped;
+
+    friend class OTMLSharedNode;
+};
+
+// read-only view stacking several documents as if each layer had been added over the ones below
+// it with OTMLNode::addChild, except that a node merged from several layers shows the value of the
+// top one where addChild keeps the first; lookups search the layers when first made and are cached
+class OTMLOverlay {
+public:
+    static OTMLOverlayPtr create() { return OTMLOverlayPtr(new OTMLOverlay(false)); }
+
+    // the new layer takes precedence over the previous ones, layers are not copied,
+    // invalidate() must be called after modifying one that was already queried
+    void addLayer(const OTMLNodePtr& layer);
+    int layerCount() const { return m_layers.size(); }
+    const OTMLNodePtr& layer(int index) const { return m_layers[index]; }
+    void invalidate();
+
+    std::string tag() const { return top()->tag(); }
+    int size() { resolveChildren(); return m_entries.size(); }
+    std::string source() const { return top()->source(); }
+    std::string rawValue() const { return top()->rawValue(); }
+
+    bool isUnique() const { return m_unique || top()->isUnique(); }
+    bool isNull() const { return top()->isNull(); }
+
+    bool hasTag() const { return top()->hasTag(); }
+    bool hasValue() const { return top()->hasValue(); }
+    bool hasChildren() const;
+    bool hasChildAt(const std::string& childTag) { return !!get(childTag); }
+    bool hasChildAtIndex(int childIndex) { return !!getIndex(childIndex); }
+
+    OTMLOverlayPtr get(const std::string& childTag);
+    OTMLOverlayPtr getIndex(int childIndex);
+
+    OTMLOverlayPtr at(const std::string& childTag);
+    OTMLOverlayPtr atIndex(int childIndex);
+
+    // like OTMLNode::children() the null children are left out
+    const OTMLOverlayList& children() { resolveChildren(); return m_children; }
+
+    template<typename T>
+    T value() { return top()->value<T>(); }
+    template<typename T>
+    T valueAt(const std::string& childTag) { return at(childTag)->value<T>(); }
+    template<typename T>
+    T valueAtIndex(int childIndex) { return atIndex(childIndex)->value<T>(); }
+    template<typename T>
+    T valueAt(const std::string& childTag, const T& def);
+    template<typename T>
+    T valueAtIndex(int childIndex, const T& def);
+
+    // creates the merged node the overlay stands for
+    OTMLNodePtr materialize();
+
+private:
+    explicit OTMLOverlay(bool unique) : m_unique(unique), m_childrenResolved(false) { }
+
+    const OTMLNodePtr& top() const { return m_layers.back(); }
+    OTMLOverlayPtr stack(const OTMLNodePtr& layer) const;
+    void resolveChildren();
+
+    OTMLNodeList m_layers;
+    bool m_unique;
+    bool m_childrenResolved;
+    OTMLOverlayList m_entries;
+    OTMLOverlayList m_children;
+    std::map<std::string, OTMLOverlayPtr> m_lookups;
+};
+
+// read-only index of a tree by path, tags joined with '/' and list items named by their index,
+// of siblings sharing a tag only the first is reachable like with get(), null nodes are left out;
+// lookups first re-index the subtrees modified since the view's previous lookup
+class OTMLPathView {
+public:
+    explicit OTMLPathView(const OTMLNodePtr& root) : m_root(root), m_generation(0) { }
+
+    OTMLNodePtr get(const std::string& path);
+    OTMLNodePtr at(const std::string& path);
+
+    template<typename T>
+    T valueAt(const std::string& path) { return at(path)->value<T>(); }
+    template<typename T>
+    T valueAt(const std::string& path, const T& def);
+
+    std::size_t size() { refresh(); return m_paths.size(); }
+    void refresh();
+
+private:
+    struct Entry {
+        OTMLNodePtr node;
+        std::vector<std::string> children;
+    };
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+    typedef std::unordered_map<std::string, Entry> PathMap;
+    typedef std::unordered_set<std::string> PathSet;
+#else
+    typedef boost::unordered_map<std::string, Entry> PathMap;
+    typedef boost::unordered_set<std::string> PathSet;
+#endif
+
+    void index(const std::string& path, const OTMLNodePtr& node, boost::uint64_t since);
+    void erase(const std::string& path);
+
+    OTMLNodePtr m_root;
+    PathMap m_paths;
+    // changeGeneration() of the previous refresh that indexed anything, 0 before the first one
+    boost::uint64_t m_generation;
+};
+
+// writes values at paths like OTMLNode::writeAtPath, remembering the parents resolved on the way
+// so a batch of writes sharing prefixes looks each of them up once, only the last tag of a path
+// is searched among its siblings; a remembered parent that was since removed, replaced, retagged
+// or nulled is looked up again
+class OTMLPathWriter {
+public:
+    explicit OTMLPathWriter(const OTMLNodePtr& root) : m_root(root) { }
+
+    template<typename T>
+    void write(const std::string& path, const T& v) { resolve(path)->write(v); }
+    // node at the path, created along with its missing parents
+    OTMLNodePtr resolve(const std::string& path);
+
+private:
+#ifdef __GXX_EXPERIMENTAL_CXX0X__
+    typedef std::unordered_map<std::string, OTMLNodePtr> NodeMap;
+#else
+    typedef boost::unordered_map<std::string, OTMLNodePtr> NodeMap;
+#endif
+
+    OTMLNodePtr resolveParent(const std::string& path);
+    bool isInPlace(const OTMLNode* node, const std::string& path) const;
+
+    OTMLNodePtr m_root;
+    NodeMap m_nodes;
+};
+
+// document kept as a manifest listing its top level nodes plus shard files holding them,
+// a shard is parsed the first time one of its nodes is accessed; the nodes handed out
+// belong to a document per shard, so their parent() is that document and not a common root
+class OTMLShardedDocument {
+public:
+    // with maxShardBytes 0 each top level node gets a shard of its own, otherwise consecutive
+    // nodes are packed while their emitted text fits, a node larger than that is never split;
+    // shards are written next to the manifest, named after it, and left untouched when unchanged,
+    // files the manifest on disk lists are only removed once a new manifest has replaced it
+    static bool save(const OTMLDocumentPtr& doc, const std::string& manifestFile, std::size_t maxShardBytes = 0);
+    // the options also apply to the shards
+    static OTMLShardedDocumentPtr open(const std::string& manifestFile, const OTMLParseOptions& options = OTMLParseOptions());
+
+    int size() const { return m_entries.size(); }
+    int shardCount() const { return m_shards.size(); }
+    int shardOf(int childIndex) const { return m_entries[childIndex].shard; }
+    bool isShardLoaded(int shard) const { return !!m_shards[shard].doc; }
+    void loadShard(int shard);
+    // unsaved changes to the nodes of the shard are lost
+    void unloadShard(int shard) { m_shards[shard].doc.reset(); }
+
+    bool hasChildAt(const std::string& childTag) { return !!get(childTag); }
+    bool hasChildAtIndex(int childIndex) { return !!getIndex(childIndex); }
+
+    OTMLNodePtr get(const std::string& childTag);
+    OTMLNodePtr getIndex(int childIndex);
+
+    OTMLNodePtr at(const std::string& childTag);
+    OTMLNodePtr atIndex(int childIndex);
+
+    template<typename T>
+    T valueAt(const std::string& childTag) { return at(childTag)->value<T>(); }
+    template<typename T>
+    T valueAtIndex(int childIndex) { return atIndex(childIndex)->value<T>(); }
+    template<typename T>
+    T valueAt(const std::string& childTag, const T& def);
+    template<typename T>
+    T valueAtIndex(int childIndex, const T& def);
+
+    // these load every shard, toDocument() copies the nodes
+    OTMLNodeList children();
+    OTMLDocumentPtr toDocument();
+
+    // rewrites the loaded shards that changed, top level nodes added, removed or retagged
+    // through their shard document are only seen by lookups after this
+    bool save();
+
+private:
+    struct Shard {
+        std::string file;
+        int first;
+        int count;
+        OTMLDocumentPtr doc;
+    };
+    struct Entry {
+        std::string tag;
+        int shard;
+    };
+
+    OTMLShardedDocument(const std::string& manifestFile, const OTMLParseOptions& options);
+
+    static std::string shardFileName(const std::string& manifestFile, int shard, bool alternate = false);
+    static bool writeFile(const std::string& fileName, const std::string& data);
+    static bool writeShard(const std::string& directory, const std::string& manifestFile, int shard,
+                           const std::set<std::string>& listed, const std::string& data, std::string& file);
+    static bool writeManifest(const std::string& manifestFile, const std::vector<Shard>& shards, const std::vector<Entry>& entries);
+    static void listedFiles(const std::string& manifestFile, std::set<std::string>& files);
+    static void removeStaleShards(const std::string& directory, const std::set<std::string>& listed,
+                                  const std::vector<Shard>& shards);
+
+    OTMLNodePtr node(int childIndex);
+
+    std::string m_manifestFile;
+    std::string m_directory;
+    OTMLParseOptions m_options;
+    std::vector<Shard> m_shards;
+    std::vector<Entry> m_entries;
+};
+
+// records the changes made to a document as a compact binary log, apply() replays it on a replica
+// holding the same content as the document had when recording started; nodes are addressed by
+// their child index path, values are sent whole and source locations are not replicated
+class OTMLPatchLog : public OTMLChangeListener {
+public:
+    explicit OTMLPatchLog(const OTMLDocumentPtr& doc) : m_doc(doc) { doc->addChangeListener(this); }
+    virtual ~OTMLPatchLog() { m_doc->removeChangeListener(this); }
+
+    const std::string& data() const { return m_data; }
+    // returns the changes recorded since the previous call
+    std::string take() { std::string data; data.swap(m_data); return data; }
+
+    static void apply(const OTMLNodePtr& root, const std::string& patch);
+
+    virtual void onChange(const OTMLChange& change);
+
+private:
+    OTMLPatchLog(const OTMLPatchLog&);
+    OTMLPatchLog& operator=(const OTMLPatchLog&);
+
+    enum Op {
+        SetTagOp = 1,
+        SetValueOp,
+        SetFlagsOp,
+        InsertOp,
+        RemoveOp,
+        ClearOp
+    };
+
+    class Reader {
+    public:
+        explicit Reader(const std::string& data) : data(data), pos(0) { }
+        bool atEnd() const { return pos == data.length(); }
+        boost::uint64_t number();
+        std::string string();
+        OTMLNodePtr node(const OTMLNodePtr& parent, int depth);
+    private:
+        const std::string& data;
+        std::size_t pos;
+    };
+
+    static void writeNumber(std::string& out, boost::uint64_t value);
+    static void writeString(std::string& out, const char* data, std::size_t length);
+    static void writeNode(std::string& out, const OTMLNodePtr& node);
+    static int flagsOf(const OTMLNode* node) { return (node->isUnique() ? 1 : 0) | (node->isNull() ? 2 : 0); }
+    void writePath(const OTMLNode* node);
+
+    static OTMLNodePtr resolve(const OTMLNodePtr& root, Reader& reader);
+
+    OTMLDocumentPtr m_doc;
+    std::string m_data;
+};
+
+// what changed on a node over a batch, children both added and removed within it are left out
+struct OTMLNodeChanges {
+    OTMLNodeChanges() : tagChanged(false), valueChanged(false), flagsChanged(false), cleared(false) { }
+
+    OTMLNodePtr node;
+    bool tagChanged;
+    bool valueChanged;
+    // unique or null
+    bool flagsChanged;
+    // the children were cleared, those removed by it are not listed
+    bool cleared;
+    OTMLNodeList added;
+    OTMLNodeList removed;
+};
+
+typedef std::vector<OTMLNodeChanges> OTMLChangeSet;
+
+class OTMLObserver {
+public:
+    virtual ~OTMLObserver() { }
+    // nodes are listed in the order they were first changed
+    virtual void onChanges(const OTMLChangeSet& changes) = 0;
+};
+
+// delivers the changes made to a document to the observers of its nodes, coalesced per node
+// until the outermost batch ends, or one at a time outside of batches; the document is only
+// listened to while something is subscribed, so unobserved documents pay nothing
+class OTMLObservers : public OTMLChangeListener {
+public:
+    explicit OTMLObservers(const OTMLDocumentPtr& doc) : m_doc(doc), m_batchDepth(0), m_delivering(false) { }
+    virtual ~OTMLObservers() { if(!m_subscriptions.empty()) m_doc->removeChangeListener(this); }
+
+    // with subtree set the changes to the node's descendants are delivered too,
+    // observers are not owned
+    void subscribe(const OTMLNodePtr& node, OTMLObserver* observer, bool subtree = false);
+    void unsubscribe(const OTMLNodePtr& node, OTMLObserver* observer);
+
+    void beginBatch() { m_batchDepth++; }
+    void endBatch();
+    bool inBatch() const { return m_batchDepth > 0; }
+
+    virtual void onChange(const OTMLChange& change);
+
+private:
+    OTMLObservers(const OTMLObservers&);
+    OTMLObservers& operator=(const OTMLObservers&);
+
+    struct Subscription {
+        OTMLNodePtr node;
+        OTMLObserver* observer;
+        bool subtree;
+    };
+    typedef std::multimap<const OTMLNode*, Subscription> SubscriptionMap;
+
+    OTMLNodeChanges& changesOf(const OTMLNodePtr& node);
+    void deliver();
+    void deliverPending();
+
+    OTMLDocumentPtr m_doc;
+    SubscriptionMap m_subscriptions;
+    OTMLChangeSet m_pending;
+    std::map<const OTMLNode*, std::size_t> m_pendingIndex;
+    int m_batchDepth;
+    bool m_delivering;
+};
+
+// one field of a list of records, stored contiguously by type
+class OTMLColumn {
+public:
+    enum Type {
+        IntColumn,
+        DoubleColumn,
+        BoolColumn,
+        StringColumn
+    };
+
+    OTMLColumn(const std::string& field, Type type) : m_field(field), m_type(type), m_size(0) { }
+
+    const std::string& field() const { return m_field; }
+    Type type() const { return m_type; }
+    std::size_t size() const { return m_size; }
+
+    // whether the record at row has the field, rows without it hold 0 or an empty string
+    bool has(std::size_t row) const { return (m_presence[row / 64] >> (row % 64)) & 1; }
+    const std::vector<boost::uint64_t>& presence() const { return m_presence; }
+
+    const std::vector<long>& ints() const { return m_ints; }
+    const std::vector<double>& doubles() const { return m_doubles; }
+    const std::vector<unsigned char>& bools() const { return m_bools; }
+    // strings are interned, each row holds an index into strings()
+    const std::vector<boost::uint32_t>& stringIds() const { return m_stringIds; }
+    const std::vector<std::string>& strings() const { return m_strings; }
+    const std::string& string(std::size_t row) const { return m_strings[m_stringIds[row]]; }
+
+private:
+    void addRow();
+    // drops the last row and the strings interned after stringCount
+    void removeRow(std::size_t stringCount);
+    void set(const OTMLNodePtr& node);
+
+    std::string m_field;
+    Type m_type;
+    std::size_t m_size;
+    std::vector<boost::uint64_t> m_presence;
+    std::vector<long> m_ints;
+    std::vector<double> m_doubles;
+    std::vector<unsigned char> m_bools;
+    std::vector<boost::uint32_t> m_stringIds;
+    std::vector<std::string> m_strings;
+    std::map<std::string, boost::uint32_t> m_interned;
+
+    friend class OTMLColumns;
+};
+
+// extracts the fields of homogeneous records, the children of a list node, in a single pass
+class OTMLColumns {
+public:
+    OTMLColumns() : m_rows(0) { }
+
+    void addColumn(const std::string& field, OTMLColumn::Type type);
+    // appends a row for every non null child of list, a field that fails to convert
+    // throws and leaves the rows of the records before it only
+    void extract(const OTMLNodePtr& list);
+
+    std::size_t rows() const { return m_rows; }
+    int columnCount() const { return m_columns.size(); }
+    const OTMLColumn& column(int index) const { return m_columns[index]; }
+    const OTMLColumn& column(const std::string& field) const;
+
+private:
+    std::vector<OTMLColumn> m_columns;
+    std::size_t m_rows;
+};
+
+#ifdef OTML_PARALLEL
+// fixed set of threads, each with its own task deque: a thread pushes and pops at the back
+// of its deque and steals from the front of the others when it runs out of work
+class OTMLTaskPool {
+public:
+    typedef std::function<void()> Task;
+
+    // 0 threads uses one per hardware thread
+    explicit OTMLTaskPool(int threads = 0);
+    ~OTMLTaskPool();
+
+    int threadCount() const { return workers.size(); }
+    static OTMLTaskPool& shared();
+
+    // tasks waited for together, waiting runs queued tasks before blocking,
+    // so groups can be nested inside tasks
+    class Group {
+    public:
+        explicit Group(OTMLTaskPool& pool) : pool(pool), pending(0) { }
+        ~Group() { join(); }
+
+        void run(const Task& task);
+        // rethrows the first exception thrown by a task
+        void wait();
+
+    private:
+        Group(const Group&);
+        Group& operator=(const Group&);
+
+        void join();
+
+        OTMLTaskPool& pool;
+        std::atomic<int> pending;
+        std::exception_ptr error;
+        // guards error and the last decrement of pending, which join waits for
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    OTMLTaskPool(const OTMLTaskPool&);
+    OTMLTaskPool& operator=(const OTMLTaskPool&);
+
+    int currentQueue() const;
+    void push(const Task& task);
+    bool runOne();
+    void workerLoop(int index);
+
+    // one queue per worker plus a last one for tasks pushed from other threads
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> queued;
+    std::atomic<bool> stopping;
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+};
+
+// whole tree operations spread over a task pool, subtrees of at least threshold nodes
+// become separate tasks while smaller ones are processed by the task reaching them
+class OTMLParallel {
+public:
+    static OTMLNodePtr clone(const OTMLNodePtr& node, OTMLTaskPool& pool = OTMLTaskPool::shared(), std::size_t threshold = 4096);
+    // same value as OTMLNode::hash()
+    static boost::uint64_t hash(const OTMLNodePtr& node, OTMLTaskPool& pool = OTMLTaskPool::shared(), std::size_t threshold = 4096);
+
+    // post-order reduction, combine(node, childResults) is called once per node and
+    // concurrently for different subtrees, so it must only touch the node it is given
+    template<typename T, typename Combine>
+    static T reduce(const OTMLNodePtr& node, Combine combine, OTMLTaskPool& pool = OTMLTaskPool::shared(), std::size_t threshold = 4096);
+
+private:
+    static std::size_t countSubtrees(const OTMLNodePtr& node, std::vector<std::size_t>& sizes);
+    template<typename T, typename Combine>
+    static T reduceSequential(const OTMLNodePtr& node, Combine& combine);
+    template<typename T, typename Combine>
+    static T reduceNode(const OTMLNodePtr& node, std::size_t index, const std::vector<std::size_t>& sizes,
+                        Combine& combine, OTMLTaskPool& pool, std::size_t threshold);
+};
+#endif
+
+class OTMLEmitter {
+public:
+    enum Flag {
+        UseCache = 1 << 0,
+        ValidateUtf8 = 1 << 1
+    };
+
+    static std::string emitNode(const OTMLNodePtr& node, int currentDepth = -1, int flags = 0);
+    static void emitNode(const OTMLNodePtr& node, int currentDepth, std::string& out, int flags,
+                         OTMLProgressListener* listener = NULL, const OTMLCancellationToken* cancellation = NULL);
+
+    // single line values that would not read back the same when written as is
+    template<typename String>
+    static bool needsQuoting(const String& value);
+    // value in quotes, escaped so that otml_util::unquote gives it back
+    template<typename String>
+    static void emitQuoted(const String& value, std::string& out);
+
+private:
+    struct Context {
+        int flags;
+        OTMLProgressListener* listener;
+        const OTMLCancellationToken* cancellation;
+        std::size_t nodes;
+        std::size_t nextCheck;
+        // text the parent of the node being emitted had at the previous emit and where it starts
+        // in it, what it starts at now, so cached children are copied and their offsets updated
+        const std::string* cacheText;
+        std::size_t cacheStart;
+        std::size_t parentStart;
+    };
+
+    static void emitNode(const OTMLNodePtr& node, int currentDepth, std::string& out, Context& context);
+    static void emitNodeText(const OTMLNodePtr& node, int currentDepth, std::string& out, Context& context);
+    static void checkProgress(const OTMLNodePtr& node, const std::string& out, Context& context);
+    static void emitIndent(int depth, std::string& out);
+};
+
+inline OTMLException::OTMLException(const OTMLNodePtr& node, const std::string& error) {
+    std::stringstream ss;
+    ss << "OTML error";
+    if(!node->source().empty())
+        ss << " in '" << node->source() << "'";
+    ss << ": " << error;
+    m_what = ss.str();
+}
+
+inline OTMLException::OTMLException(const OTMLDocumentPtr& doc, const std::string& error, int line) {
+    std::stringstream ss;
+    ss << "OTML error";
+    if(doc && !doc->source().empty()) {
+        ss  << " in '" << doc->source() << "'";
+        if(line >= 0)
+            ss << " at line " << line;
+    }
+    ss << ": "  << error;
+    m_what = ss.str();
+}
+
+inline OTMLNodePtr OTMLNode::create(std::string tag, bool unique) {
+    OTMLNodePtr node(new OTMLNode);
+    node->setTag(tag);
+    node->setUnique(unique);
+    return node;
+}
+
+inline OTMLNodePtr OTMLNode::create(std::string tag, std::string value) {
+    OTMLNodePtr node(new OTMLNode);
+    node->setTag(tag);
+    node->setValue(value);
+    node->setUnique(true);
+    return node;
+}
+
+#ifdef OTML_USE_PMR
+template<typename T>
+struct OTMLResourceDeleter {
+    OTMLMemoryResource* resource;
+    void operator()(T* p) const {
+        p->~T();
+        resource->deallocate(p, sizeof(T), alignof(T));
+    }
+};
+
+template<typename T>
+std::shared_ptr<T> OTMLNode::allocate(OTMLMemoryResource* resource) {
+    if(!resource)
+        resource = std::pmr::get_default_resource();
+    void* mem = resource->allocate(sizeof(T), alignof(T));
+    T* p;
+    try {
+        p = new(mem) T(resource);
+    } catch(...) {
+        resource->deallocate(mem, sizeof(T), alignof(T));
+        throw;
+    }
+    OTMLResourceDeleter<T> deleter = { resource };
+    return std::shared_ptr<T>(p, deleter, std::pmr::polymorphic_allocator<char>(resource));
+}
+
+inline OTMLNodePtr OTMLNode::create(OTMLMemoryResource* resource, const std::string& tag, bool unique) {
+    OTMLNodePtr node = allocate<OTMLNode>(resource);
+    node->setTag(tag);
+    node->setUnique(unique);
+    return node;
+}
+#endif
+
+inline OTMLNodePtr OTMLNode::createChild(const std::string& tag, bool unique) const {
+#ifdef OTML_USE_PMR
+    return create(memoryResource(), tag, unique);
+#else
+    return create(tag, unique);
+#endif
+}
+
+inline std::string OTMLNode::source() const {
+    if(!m_sourceFile)
+        return std::string();
+    if(m_sourceLine <= 0)
+        return *m_sourceFile;
+    return *m_sourceFile + ":" + otml_util::safeCast<std::string>(m_sourceLine);
+}
+
+inline void OTMLNode::setSource(const std::string& source) {
+    if(source.empty())
+        m_sourceFile.reset();
+    else
+        m_sourceFile.reset(new std::string(source));
+    m_sourceLine = 0;
+}
+
+inline void OTMLNode::markDirty() {
+    // the marks are only set on a node once they are set on all its children, so past the
+    // parent, whose paths change with the node's tag, the walk can stop at the first ancestor
+    // with no mark left to clear: views already know it changed and have stamps on its way up
+    const int marks = EmitCachedFlag | SavedFlag | IndexedFlag;
+    const boost::uint64_t generation = otml_util::changeGeneration();
+    OTMLNode* node = this;
+    for(int steps = 0; node && (steps < 2 || (node->m_flags & marks)); ++steps) {
+        OTMLNode* parent = node->m_parent.lock().get();
+        // the document itself is never marked saved, it learns here that a saved child changed
+        if(parent && node->hasFlag(SavedFlag) && !parent->hasFlag(SavedFlag))
+            parent->setFlag(ChildrenChangedFlag, true);
+        node->m_flags &= ~marks;
+        node->m_changeStamp = generation;
+        node = parent;
+    }
+}
+
+inline void OTMLNode::markSaved() {
+    for(OTMLNodeStorage::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+        if(!(*it)->hasFlag(SavedFlag)) {
+            (*it)->setFlag(SavedFlag, true);
+            (*it)->markSaved();
+        }
+    }
+}
+
+inline void OTMLNode::dispatchChange(OTMLChange::Type type, int index, const OTMLNodePtr& child) {
+    if(type == OTMLChange::ChildAdded)
+        child->setObserved(true);
+    // the open transaction reports the change on commit
+    if(hasFlag(TouchedFlag))
+        return;
+
+    OTMLDocument* doc = observingDocument();
+    if(doc)
+        doc->reportChange(type, shared_from_this(), index, child);
+}
+
+inline void OTMLNode::dispatchTouch() {
+    OTMLDocument* doc = observingDocument();
+    if(!doc || !doc->m_inTransaction)
+        return;
+
+    doc->saveNode(shared_from_this());
+}
+
+inline void OTMLNode::dispatchDetached(const OTMLNodePtr& child) {
+    OTMLDocument* doc = observingDocument();
+    if(doc && doc->m_inTransaction)
+        doc->saveDetached(child);
+}
+
+inline OTMLDocument* OTMLNode::observingDocument() {
+    OTMLNode* root = this;
+    while(OTMLNode* parent = root->m_parent.lock().get())
+        root = parent;
+    OTMLDocument* doc = dynamic_cast<OTMLDocument*>(root);
+    if(doc && (!doc->m_changeListeners.empty() || doc->m_inTransaction))
+        return doc;
+
+    // detached nodes and nodes of a document nobody observes anymore keep their mark,
+    // it is dropped along the path so later changes there only cost the flag test
+    for(OTMLNode* node = this; node; node = node->m_parent.lock().get())
+        node->setFlag(ObservedFlag, false);
+    return NULL;
+}
+
+inline void OTMLNode::setObserved(bool observed) {
+    // marked nodes always have their whole subtree marked
+    if(observed && hasFlag(ObservedFlag))
+        return;
+    setFlag(ObservedFlag, observed);
+    for(OTMLNodeStorage::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it)
+        (*it)->setObserved(observed);
+}
+
+inline void OTMLNode::dropEmitCache() {
+    if(m_extra) {
+        std::string().swap(m_extra->emitText);
+        m_extra->emitDepth = -1;
+    }
+    setFlag(EmitCachedFlag, false);
+    for(OTMLNodeStorage::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it)
+        (*it)->dropEmitCache();
+}
+
+inline void OTMLNode::setBlockValue(const std::string& source, std::size_t begin, std::size_t end, int indent, char chomp, bool toEnd) {
+    m_value.clear();
+    m_value.reserve(end - begin + 1);
+
+    // lines indented less than the block are blank ones, the parser rejects anything else
+    std::size_t pos = begin;
+    while(pos < end) {
+        std::size_t lineEnd = source.find('\n', pos);
+        if(lineEnd == std::string::npos || lineEnd > end)
+            lineEnd = end;
+        if(lineEnd - pos >= (std::size_t)indent && source.compare(pos, indent, std::string(indent, ' ')) == 0)
+            m_value.append(source.data() + pos + indent, lineEnd - pos - indent);
+        m_value += '\n';
+        pos = lineEnd + 1;
+    }
+    // a block reaching the end of input also counts the empty line after its last newline
+    if(toEnd && pos == end)
+        m_value += '\n';
+
+    if(chomp != '+') {
+        std::size_t last = m_value.find_last_not_of('\n');
+        m_value.erase(last == std::string::npos ? 0 : last + 1);
+        if(chomp != '-')
+            m_value += '\n';
+    }
+    markDirty();
+}
+
+inline bool OTMLNode::hasChildren() const {
+    int count = 0;
+    for(OTMLNodeStorage::const_iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+        const OTMLNodePtr& child = *it;
+        if(!child->isNull())
+            count++;
+    }
+    return count > 0;
+}
+
+inline OTMLNodePtr OTMLNode::get(const std::string& childTag) const {
+    for(OTMLNodeStorage::const_iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+        const OTMLNodePtr& child = *it;
+        if(child->tag() == childTag && !child->isNull())
+            return child;
+    }
+    return OTMLNodePtr();
+}
+
+inline OTMLNodePtr OTMLNode::getIndex(int childIndex) const {
+    if(childIndex < size() && childIndex >= 0)
+        return m_children[childIndex];
+    return OTMLNodePtr();
+}
+
+inline OTMLNodePtr OTMLNode::at(const std::string& childTag) {
+    OTMLNodePtr res;
+    for(OTMLNodeStorage::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+        const OTMLNodePtr& child = *it;
+        if(child->tag() == childTag && !child->isNull()) {
+            res = child;
+            break;
+        }
+    }
+    if(!res) {
+        std::stringstream ss;
+        ss << "child node with tag '" << childTag << "' not found";
+        throw OTMLException(shared_from_this(), ss.str());
+    }
+    return res;
+}
+
+inline OTMLNodePtr OTMLNode::atIndex(int childIndex) {
+    if(childIndex >= size() || childIndex < 0) {
+        std::stringstream ss;
+        ss << "child node with index '" << childIndex << "' not found";
+        throw OTMLException(shared_from_this(), ss.str());
+    }
+    return m_children[childIndex];
+}
+
+inline void OTMLNode::addChild(const OTMLNodePtr& newChild) {
+    if(newChild->hasTag()) {
+        for(OTMLNodeStorage::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+            const OTMLNodePtr& node = *it;
+            if(node->tag() == newChild->tag() && (node->isUnique() || newChild->isUnique())) {
+                if(node->hasChildren() && newChild->hasChildren()) {
+                    OTMLNodePtr tmpNode = node->clone();
+                    tmpNode->merge(newChild);
+                    newChild->copy(tmpNode);
+                }
+                // after copy(), which takes the flags of the node being replaced
+                newChild->setUnique(true);
+
+                replaceChild(node, newChild);
+                OTMLNodeStorage::iterator it = m_children.begin();
+                while(it != m_children.end()) {
+                    OTMLNodePtr node = (*it);
+                    if(node != newChild && node->tag() == newChild->tag()) {
+                        int index = it - m_children.begin();
+                        node->m_parent.reset();
+                        setFlag(ChildrenChangedFlag, true);
+                        it = m_children.erase(it);
+                        detached(node);
+                        notify(OTMLChange::ChildRemoved, index, node);
+                    } else
+                        ++it;
+                }
+                return;
+            }
+        }
+    }
+    appendChild(newChild);
+}
+
+inline void OTMLNode::appendChild(const OTMLNodePtr& newChild) {
+    touch();
+    m_children.push_back(newChild);
+    newChild->m_parent = shared_from_this();
+    newChild->dropMovedEmitCache();
+    markDirty();
+    notify(OTMLChange::ChildAdded, m_children.size() - 1, newChild);
+}
+
+inline OTMLNodePtr OTMLNode::resolveChild(const std::string& childTag) {
+    bool nullMatch = false;
+    for(OTMLNodeStorage::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+        const OTMLNodePtr& child = *it;
+        if(childTag.compare(0, std::string::npos, child->m_tag.data(), child->m_tag.size()) != 0)
+            continue;
+        if(!child->isNull())
+            return child;
+        nullMatch = true;
+    }
+    OTMLNodePtr child = createChild(childTag, true);
+    // a null node with the tag is replaced by the new one
+    if(nullMatch)
+        addChild(child);
+    else
+        appendChild(child);
+    return child;
+}
+
+inline bool OTMLNode::removeChild(const OTMLNodePtr& oldChild) {
+    OTMLNodeStorage::iterator it = std::find(m_children.begin(), m_children.end(), oldChild);
+    if(it != m_children.end()) {
+        touch();
+        int index = it - m_children.begin();
+        m_children.erase(it);
+        oldChild->m_parent.reset();
+        setFlag(ChildrenChangedFlag, true);
+        markDirty();
+        detached(oldChild);
+        notify(OTMLChange::ChildRemoved, index, oldChild);
+        return true;
+    }
+    return false;
+}
+
+inline bool OTMLNode::replaceChild(const OTMLNodePtr& oldChild, const OTMLNodePtr& newChild) {
+    OTMLNodeStorage::iterator it = std::find(m_children.begin(), m_children.end(), oldChild);
+    if(it != m_children.end()) {
+        touch();
+        // oldChild may be a reference to the slot being overwritten
+        OTMLNodePtr removed = *it;
+        int index = it - m_children.begin();
+        removed->m_parent.reset();
+        newChild->m_parent = shared_from_this();
+        newChild->dropMovedEmitCache();
+        *it = newChild;
+        setFlag(ChildrenChangedFlag, true);
+        markDirty();
+        detached(removed);
+        notify(OTMLChange::ChildRemoved, index, removed);
+        notify(OTMLChange::ChildAdded, index, newChild);
+        return true;
+    }
+    return false;
+}
+
+inline void OTMLNode::copy(const OTMLNodePtr& node)
+{
+    setTag(node->tag());
+    setValue(node->rawValue());
+    setUnique(node->isUnique());
+    setNull(node->isNull());
+    setSource(node->sourceFile(), node->sourceLine());
+    clear();
+    for(OTMLNodeStorage::iterator it = node->m_children.begin(), end = node->m_children.end(); it != end; ++it) {
+        const OTMLNodePtr& child = *it;
+        addChild(child->clone());
+    }
+}
+
+inline void OTMLNode::merge(const OTMLNodePtr& node) {
+    for(OTMLNodeStorage::iterator it = node->m_children.begin(), end = node->m_children.end(); it != end; ++it) {
+        const OTMLNodePtr& child = *it;
+        addChild(child->clone());
+    }
+    setTag(node->tag());
+    setSource(node->sourceFile(), node->sourceLine());
+}
+
+inline void OTMLNode::clear() {
+    touch();
+    for(OTMLNodeStorage::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+        const OTMLNodePtr& child = *it;
+        child->m_parent.reset();
+        detached(child);
+    }
+    m_children.clear();
+    setFlag(ChildrenChangedFlag, true);
+    markDirty();
+    notify(OTMLChange::ChildrenCleared);
+}
+
+inline OTMLNodeList OTMLNode::children() const {
+    OTMLNodeList children;
+    for(OTMLNodeStorage::const_iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+        const OTMLNodePtr& child = *it;
+        if(!child->isNull())
+            children.push_back(child);
+    }
+    return children;
+}
+
+inline OTMLNodePtr OTMLNode::clone() const {
+    OTMLNodePtr myClone = cloneNode();
+    for(OTMLNodeStorage::const_iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+        const OTMLNodePtr& child = *it;
+        myClone->addChild(child->clone());
+    }
+    return myClone;
+}
+
+inline OTMLNodePtr OTMLNode::cloneNode() const {
+    OTMLNodePtr myClone = createChild();
+    myClone->m_tag = m_tag;
+    myClone->m_value = m_value;
+    // marks tied to the tree the node is in are not carried over
+    myClone->m_flags = m_flags & (UniqueFlag | NullFlag);
+    myClone->setSource(m_sourceFile, m_sourceLine);
+    return myClone;
+}
+
+inline boost::uint64_t OTMLNode::hash() const {
+    std::vector<boost::uint64_t> childHashes;
+    childHashes.reserve(m_children.size());
+    for(OTMLNodeStorage::const_iterator it = m_children.begin(), end = m_children.end(); it != end; ++it)
+        childHashes.push_back((*it)->hash());
+    return hashNode(childHashes);
+}
+
+inline boost::uint64_t OTMLNode::hashNode(const std::vector<boost::uint64_t>& childHashes) const {
+    // lengths are mixed in so moving characters between tag and value changes the hash
+    boost::uint64_t h = otml_util::hashBytes(14695981039346656037ULL, m_tag.data(), m_tag.size());
+    h = otml_util::hashValue(h, m_tag.size());
+    h = otml_util::hashBytes(h, m_value.data(), m_value.size());
+    h = otml_util::hashValue(h, m_value.size());
+    h = otml_util::hashValue(h, (isUnique() ? 1 : 0) | (isNull() ? 2 : 0));
+    h = otml_util::hashValue(h, childHashes.size());
+    for(std::size_t i=0;i<childHashes.size();++i)
+        h = otml_util::hashValue(h, childHashes[i]);
+    return h;
+}
+
+inline std::string OTMLNode::emit() {
+    return OTMLEmitter::emitNode(shared_from_this(), 0);
+}
+
+template<>
+inline std::string OTMLNode::value() {
+    return otml_util::unquote(rawValue());
+}
+
+template<typename T>
+T OTMLNode::value() {
+    T ret;
+    if(!otml_util::cast(m_value, ret))
+        throw OTMLException(shared_from_this(), "failed to cast node value");
+    return ret;
+}
+
+template<typename T>
+T OTMLNode::valueAt(const std::string& childTag) {
+    OTMLNodePtr node = at(childTag);
+    return node->value<T>();
+}
+
+template<typename T>
+T OTMLNode::valueAtIndex(int childIndex) {
+    OTMLNodePtr node = atIndex(childIndex);
+    return node->value<T>();
+}
+
+template<typename T>
+T OTMLNode::valueAt(const std::string& childTag, const T& def) {
+    if(OTMLNodePtr node = get(childTag))
+        if(!node->isNull())
+            return node->value<T>();
+    return def;
+}
+
+template<typename T>
+T OTMLNode::valueAtIndex(int childIndex, const T& def) {
+    if(OTMLNodePtr node = getIndex(childIndex))
+        return node->value<T>();
+    return def;
+}
+
+template<typename T>
+void OTMLNode::write(const T& v) {
+    std::string value = otml_util::safeCast<std::string>(v);
+    // value() strips the quotes around a string, so a string that has its own is stored quoted
+    if(value.length() > 1 && value[0] == '"' && value[value.length()-1] == '"') {
+        std::string quoted;
+        OTMLEmitter::emitQuoted(value, quoted);
+        value.swap(quoted);
+    }
+    setValue(value);
+}
+
+template<typename T>
+void OTMLNode::writeAt(const std::string& childTag, const T& v) {
+    OTMLNodePtr child = createChild(childTag, true);
+    child->write<T>(v);
+    addChild(child);
+}
+
+template<typename T>
+void OTMLNode::writeIn(const T& v) {
+    OTMLNodePtr child = createChild();
+    child->write<T>(v);
+    addChild(child);
+}
+
+template<typename T>
+void OTMLNode::writeAtPath(const std::string& path, const T& v) {
+    // checked first so a bad path leaves the tree untouched
+    if(!otml_util::isTagPath(path))
+        throw OTMLException(shared_from_this(), "invalid path '" + path + "'");
+    OTMLNodePtr node = shared_from_this();
+    std::size_t begin = 0;
+    for(;;) {
+        std::size_t end = path.find('/', begin);
+        node = node->resolveChild(path.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+        if(end == std::string::npos)
+            break;
+        begin = end + 1;
+    }
+    node->write<T>(v);
+}
+
+inline OTMLDocumentPtr OTMLDocument::allocateDocument(const OTMLParseOptions& options) {
+#ifdef OTML_USE_PMR
+    return allocate<OTMLDocument>(options.memoryResource);
+#else
+    (void)options;
+    return OTMLDocumentPtr(new OTMLDocument);
+#endif
+}
+
+inline OTMLDocumentPtr OTMLDocument::create() {
+    OTMLDocumentPtr doc = allocateDocument(OTMLParseOptions());
+    doc->setTag("doc");
+    return doc;
+}
+
+#ifdef OTML_USE_PMR
+inline OTMLDocumentPtr OTMLDocument::create(OTMLMemoryResource* resource) {
+    OTMLDocumentPtr doc = allocate<OTMLDocument>(resource);
+    doc->setTag("doc");
+    return doc;
+}
+#endif
+
+inline OTMLDocumentPtr OTMLDocument::parse(const std::string& fileName, const OTMLParseOptions& options) {
+    std::ifstream fin(fileName.c_str());
+    if(!fin.good()) {
+        std::stringstream ss;
+        ss << "failed to open file " << fileName;
+        throw OTMLException(ss.str());
+    }
+    return parse(fin, fileName, options);
+}
+
+inline OTMLDocumentPtr OTMLDocument::parse(std::istream& in, const std::string& source, const OTMLParseOptions& options) {
+    OTMLDocumentPtr doc = allocateDocument(options);
+    doc->setSource(source);
+    OTMLParser parser(doc, in, options);
+    parser.parse();
+    doc->setSaved();
+    return doc;
+}
+
+#ifdef OTML_PARALLEL
+inline OTMLTaskPool::OTMLTaskPool(int threads) : queued(0), stopping(false) {
+    if(threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for(int i=0;i<=threads;++i)
+        queues.push_back(std::unique_ptr<Queue>(new Queue));
+    for(int i=0;i<threads;++i)
+        workers.push_back(std::thread(&OTMLTaskPool::workerLoop, this, i));
+}
+
+inline OTMLTaskPool::~OTMLTaskPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for(std::size_t i=0;i<workers.size();++i)
+        workers[i].join();
+}
+
+inline OTMLTaskPool& OTMLTaskPool::shared() {
+    static OTMLTaskPool pool;
+    return pool;
+}
+
+namespace otml_util {
+    struct TaskPoolWorker {
+        const OTMLTaskPool* pool;
+        int index;
+    };
+
+    inline TaskPoolWorker& currentTaskPoolWorker() {
+        static thread_local TaskPoolWorker worker = { NULL, -1 };
+        return worker;
+    }
+}
+
+inline int OTMLTaskPool::currentQueue() const {
+    const otml_util::TaskPoolWorker& worker = otml_util::currentTaskPoolWorker();
+    return worker.pool == this ? worker.index : queues.size() - 1;
+}
+
+inline void OTMLTaskPool::push(const Task& task) {
+    Queue& queue = *queues[currentQueue()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+    }
+    queued++;
+    wakeUp.notify_one();
+}
+
+inline bool OTMLTaskPool::runOne() {
+    if(queued == 0)
+        return false;
+    int self = currentQueue();
+    int count = queues.size();
+    Task task;
+    for(int i=0;i<count && !task;++i) {
+        Queue& queue = *queues[(self + i) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.tasks.empty())
+            continue;
+        // the own deque is used as a stack for locality, others are robbed of their oldest and largest tasks
+        if(i == 0) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        } else {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+    }
+    if(!task)
+        return false;
+    queued--;
+    task();
+    return true;
+}
+
+inline void OTMLTaskPool::workerLoop(int index) {
+    otml_util::TaskPoolWorker& worker = otml_util::currentTaskPoolWorker();
+    worker.pool = this;
+    worker.index = index;
+    while(!stopping) {
+        if(runOne())
+            continue;
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait_for(lock, std::chrono::milliseconds(10), [this]() { return stopping || queued > 0; });
+    }
+}
+
+inline void OTMLTaskPool::Group::run(const Task& task) {
+    pending++;
+    pool.push([this, task]() {
+        try {
+            task();
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!error)
+                error = std::current_exception();
+        }
+        // notified under the lock, join cannot return and destroy the group before this is done with it
+        std::lock_guard<std::mutex> lock(mutex);
+        if(--pending == 0)
+            done.notify_all();
+    });
+}
+
+inline void OTMLTaskPool::Group::join() {
+    // once nothing is queued anymore every task of the group has been taken by some thread,
+    // so it only remains to sleep until the last of them finishes
+    while(pending > 0 && pool.runOne()) { }
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return pending == 0; });
+}
+
+inline void OTMLTaskPool::Group::wait() {
+    join();
+    if(error) {
+        std::exception_ptr e = error;
+        error = std::exception_ptr();
+        std::rethrow_exception(e);
+    }
+}
+
+inline std::size_t OTMLParallel::countSubtrees(const OTMLNodePtr& node, std::vector<std::size_t>& sizes) {
+    std::size_t index = sizes.size();
+    sizes.push_back(1);
+    std::size_t count = 1;
+    for(int i=0;i<node->size();++i)
+        count += countSubtrees(node->atIndex(i), sizes);
+    sizes[index] = count;
+    return count;
+}
+
+template<typename T, typename Combine>
+T OTMLParallel::reduceSequential(const OTMLNodePtr& node, Combine& combine) {
+    std::vector<T> results;
+    results.reserve(node->size());
+    for(int i=0;i<node->size();++i)
+        results.push_back(reduceSequential<T>(node->atIndex(i), combine));
+    return combine(node, results);
+}
+
+template<typename T, typename Combine>
+T OTMLParallel::reduceNode(const OTMLNodePtr& node, std::size_t index, const std::vector<std::size_t>& sizes,
+                           Combine& combine, OTMLTaskPool& pool, std::size_t threshold) {
+    std::vector<T> results(node->size());
+    {
+        OTMLTaskPool::Group group(pool);
+        std::size_t childIndex = index + 1;
+        for(int i=0;i<node->size();++i) {
+            OTMLNodePtr child = node->atIndex(i);
+            if(sizes[childIndex] >= threshold) {
+                T* result = &results[i];
+                group.run([=, &sizes, &combine, &pool]() {
+                    *result = reduceNode<T>(child, childIndex, sizes, combine, pool, threshold);
+                });
+            } else
+                results[i] = reduceSequential<T>(child, combine);
+            childIndex += sizes[childIndex];
+        }
+        group.wait();
+    }
+    return combine(node, results);
+}
+
+template<typename T, typename Combine>
+T OTMLParallel::reduce(const OTMLNodePtr& node, Combine combine, OTMLTaskPool& pool, std::size_t threshold) {
+    std::vector<std::size_t> sizes;
+    if(countSubtrees(node, sizes) < threshold)
+        return reduceSequential<T>(node, combine);
+    return reduceNode<T>(node, 0, sizes, combine, pool, threshold);
+}
+
+inline OTMLNodePtr OTMLParallel::clone(const OTMLNodePtr& node, OTMLTaskPool& pool, std::size_t threshold) {
+    return reduce<OTMLNodePtr>(node, [](const OTMLNodePtr& node, std::vector<OTMLNodePtr>& children) {
+        OTMLNodePtr myClone = node->cloneNode();
+        for(std::size_t i=0;i<children.size();++i)
+            myClone->addChild(children[i]);
+        return myClone;
+    }, pool, threshold);
+}
+
+inline boost::uint64_t OTMLParallel::hash(const OTMLNodePtr& node, OTMLTaskPool& pool, std::size_t threshold) {
+    return reduce<boost::uint64_t>(node, [](const OTMLNodePtr& node, std::vector<boost::uint64_t>& children) {
+        return node->hashNode(children);
+    }, pool, threshold);
+}
+#endif
+
+#ifdef OTML_COROUTINES
+inline OTMLGenerator<OTMLNodePtr> OTMLDocument::stream(std::string fileName, OTMLParseOptions options) {
+    std::ifstream fin(fileName.c_str());
+    if(!fin.good()) {
+        std::stringstream ss;
+        ss << "failed to open file " << fileName;
+        throw OTMLException(ss.str());
+    }
+    for(const OTMLNodePtr& node : stream(fin, fileName, options))
+        co_yield node;
+}
+
+inline OTMLGenerator<OTMLNodePtr> OTMLDocument::stream(OTMLStringPtr buffer, std::string source, OTMLParseOptions options) {
+    otml_util::BufferStreamBuf buf(buffer);
+    std::istream in(&buf);
+    for(const OTMLNodePtr& node : stream(in, source, options))
+        co_yield node;
+}
+
+inline OTMLGenerator<OTMLNodePtr> OTMLDocument::stream(std::istream& in, std::string source, OTMLParseOptions options) {
+    OTMLDocumentPtr doc = allocateDocument(options);
+    doc->setSource(source);
+    OTMLStringPtr sourceFile = doc->sourceFile();
+    if(!in.good())
+        throw OTMLException(doc, "cannot read from input stream");
+
+    // progress is reported for the whole stream instead of per top level node
+    OTMLProgressListener* listener = options.progressListener;
+    options.progressListener = NULL;
+    std::size_t bytes = 0;
+    std::size_t nextReport = 65536;
+    std::size_t nodes = 0;
+
+    std::string line;
+    std::string* data = new std::string;
+    OTMLStringPtr chunk(data);
+    int chunkLine = 1;
+    int currentLine = 0;
+    bool more = true;
+    while(more) {
+        more = !!std::getline(in, line);
+        if(more) {
+            currentLine++;
+            bytes += line.length() + 1;
+            if(options.maxBytes > 0 && bytes > options.maxBytes)
+                throw OTMLLimitException(doc, "input exceeds the maximum size");
+        }
+
+        // any line starting at the first column, other than a comment, begins a new top level node
+        bool boundary = !more || (!line.empty() && !otml_util::isSpace(line[0]) && line.compare(0, 2, "//") != 0);
+        if(boundary && !data->empty()) {
+            OTMLParser parser(doc, chunk, options, chunkLine);
+            parser.parse();
+            for(int i=0;i<doc->size();++i) {
+                nodes++;
+                co_yield doc->atIndex(i);
+            }
+            if(listener && (bytes >= nextReport || !more)) {
+                listener->onProgress(bytes, 0, nodes);
+                nextReport = bytes + 65536;
+            }
+
+            doc = allocateDocument(options);
+            doc->setSource(sourceFile, 0);
+            data = new std::string;
+            chunk.reset(data);
+            chunkLine = currentLine;
+        }
+        if(more) {
+            *data += line;
+            *data += "\n";
+        }
+    }
+}
+#endif
+
+inline std::string OTMLDocument::emit() {
+    std::string out;
+    OTMLEmitter::emitNode(shared_from_this(), -1, out, emitFlags(), m_progressListener, m_cancellation);
+    out += "\n";
+    return out;
+}
+
+inline int OTMLDocument::emitFlags() const {
+    int flags = 0;
+    if(m_emitCaching)
+        flags |= OTMLEmitter::UseCache;
+    if(m_utf8Validation)
+        flags |= OTMLEmitter::ValidateUtf8;
+    return flags;
+}
+
+inline void OTMLDocument::setEmitCaching(bool enabled) {
+    if(!enabled && m_emitCaching)
+        dropEmitCache();
+    m_emitCaching = enabled;
+}
+
+inline void OTMLDocument::addChangeListener(OTMLChangeListener* listener) {
+    m_changeListeners.push_back(listener);
+    setObserved(true);
+}
+
+inline void OTMLDocument::removeChangeListener(OTMLChangeListener* listener) {
+    std::vector<OTMLChangeListener*>::iterator it = std::find(m_changeListeners.begin(), m_changeListeners.end(), listener);
+    if(it != m_changeListeners.end())
+        m_changeListeners.erase(it);
+    if(m_changeListeners.empty() && !m_inTransaction)
+        setObserved(false);
+}
+
+inline void OTMLDocument::beginTransaction() {
+    if(m_inTransaction)
+        throw OTMLException("a transaction is already open");
+    m_inTransaction = true;
+    setObserved(true);
+}
+
+inline void OTMLDocument::commitTransaction() {
+    if(!m_inTransaction)
+        throw OTMLException("no transaction is open");
+    m_inTransaction = false;
+    std::vector<SavedNode> saved;
+    saved.swap(m_saved);
+    std::set<const OTMLNode*> detached;
+    detached.swap(m_detached);
+    for(std::size_t i=0;i<saved.size();++i)
+        saved[i].node->setFlag(TouchedFlag, false);
+    if(!m_changeListeners.empty())
+        reportChanges(saved, detached);
+}
+
+inline void OTMLDocument::rollbackTransaction() {
+    if(!m_inTransaction)
+        throw OTMLException("no transaction is open");
+    m_inTransaction = false;
+    std::vector<SavedNode> saved;
+    saved.swap(m_saved);
+    m_detached.clear();
+
+    // children are taken from every changed node before being given back to their previous
+    // parent, so a node moved between two changed nodes ends up where it was
+    for(std::size_t i=0;i<saved.size();++i) {
+        OTMLNode* node = saved[i].node.get();
+        for(OTMLNodeStorage::iterator it = node->m_children.begin(), end = node->m_children.end(); it != end; ++it) {
+            if((*it)->m_parent.lock().get() == node)
+                (*it)->m_parent.reset();
+        }
+    }
+    // ChildrenChangedFlag is kept, the saved marks cleared along with it are not restored
+    const int restoredFlags = UniqueFlag | NullFlag;
+    // latest saved first, a child saved in several nodes goes back to the one that held it first
+    for(std::size_t i=saved.size();i-- > 0;) {
+        const SavedNode& s = saved[i];
+        OTMLNode* node = s.node.get();
+        node->m_tag.assign(s.tag.data(), s.tag.size());
+        node->m_value.assign(s.value.data(), s.value.size());
+        node->m_flags = static_cast<unsigned char>((node->m_flags & ~(restoredFlags | TouchedFlag)) | (s.flags & restoredFlags));
+        std::set<const OTMLNode*> present;
+        for(OTMLNodeStorage::iterator it = node->m_children.begin(), end = node->m_children.end(); it != end; ++it)
+            present.insert(it->get());
+        node->m_children.assign(s.children.begin(), s.children.end());
+        // children edited while detached lost their mark, they are back where changes are watched
+        const bool observed = node->hasFlag(ObservedFlag);
+        for(OTMLNodeStorage::iterator it = node->m_children.begin(), end = node->m_children.end(); it != end; ++it) {
+            (*it)->m_parent = s.node;
+            if(!present.count(it->get()))
+                (*it)->dropMovedEmitCache();
+            if(observed)
+                (*it)->setObserved(true);
+        }
+        node->markDirty();
+    }
+}
+
+inline void OTMLDocument::saveNode(const OTMLNodePtr& node) {
+    m_saved.push_back(SavedNode());
+    SavedNode& saved = m_saved.back();
+    saved.node = node;
+    saved.tag.assign(node->m_tag.data(), node->m_tag.size());
+    saved.value.assign(node->m_value.data(), node->m_value.size());
+    saved.flags = node->m_flags;
+    saved.children.assign(node->m_children.begin(), node->m_children.end());
+    node->setFlag(TouchedFlag, true);
+}
+
+inline void OTMLDocument::saveDetached(const OTMLNodePtr& node) {
+    // changes made outside the document are not seen, so the whole subtree is saved
+    // now for a rollback and the node is reported with its content if it comes back
+    m_detached.insert(node.get());
+    if(!node->hasFlag(TouchedFlag))
+        saveNode(node);
+    for(OTMLNodeStorage::iterator it = node->m_children.begin(), end = node->m_children.end(); it != end; ++it)
+        saveDetached(*it);
+}
+
+inline void OTMLDocument::reportChanges(const std::vector<SavedNode>& saved, const std::set<const OTMLNode*>& detached) {
+    // nodes still in the document are visited parents first and in child order, each node's
+    // children are then diffed against the saved ones, so every reported change applies to
+    // the tree as left by the previous ones and listeners can replay them elsewhere
+    std::map<const OTMLNode*, std::size_t> savedIndex;
+    // children leading to a saved node, for every node on the way to one
+    std::map<const OTMLNode*, std::vector<OTMLNode*> > leadsToSaved;
+    for(std::size_t i=0;i<saved.size();++i) {
+        savedIndex[saved[i].node.get()] = i;
+        OTMLNode* node = saved[i].node.get();
+        while(OTMLNode* parent = node->m_parent.lock().get()) {
+            std::vector<OTMLNode*>& children = leadsToSaved[parent];
+            children.push_back(node);
+            if(children.size() > 1)
+                break;
+            node = parent;
+        }
+    }
+
+    // subtrees reported as added already carry their final content and are not entered
+    std::set<const OTMLNode*> added;
+    std::vector<OTMLNode*> pending(1, this);
+    while(!pending.empty()) {
+        OTMLNode* node = pending.back();
+        pending.pop_back();
+        std::map<const OTMLNode*, std::size_t>::const_iterator found = savedIndex.find(node);
+        if(found != savedIndex.end())
+            reportChanges(saved[found->second], detached, added);
+
+        std::map<const OTMLNode*, std::vector<OTMLNode*> >::const_iterator it = leadsToSaved.find(node);
+        if(it == leadsToSaved.end())
+            continue;
+        const std::vector<OTMLNode*>& next = it->second;
+        if(next.size() == 1) {
+            if(!added.count(next[0]))
+                pending.push_back(next[0]);
+            continue;
+        }
+        // several ways down, they are taken in child order
+        std::set<const OTMLNode*> ways(next.begin(), next.end());
+        for(std::size_t i=node->m_children.size();i-- > 0;) {
+            OTMLNode* child = node->m_children[i].get();
+            if(ways.count(child) && !added.count(child))
+                pending.push_back(child);
+        }
+    }
+}
+
+inline void OTMLDocument::reportChanges(const SavedNode& s, const std::set<const OTMLNode*>& detached, std::set<const OTMLNode*>& added) {
+    OTMLNode* node = s.node.get();
+    if(s.tag.compare(0, std::string::npos, node->m_tag.data(), node->m_tag.size()) != 0)
+        reportChange(OTMLChange::TagChanged, s.node);
+    if(s.value.compare(0, std::string::npos, node->m_value.data(), node->m_value.size()) != 0)
+        reportChange(OTMLChange::ValueChanged, s.node);
+    if((s.flags ^ node->m_flags) & (UniqueFlag | NullFlag))
+        reportChange(OTMLChange::FlagsChanged, s.node);
+
+    const OTMLNodeList& before = s.children;
+    const OTMLNodeStorage& after = node->m_children;
+    if(detached.empty() && before.size() == after.size() && std::equal(before.begin(), before.end(), after.begin()))
+        return;
+
+    // children still in their previous relative order stay, the others and those that were
+    // taken out in between are removed and added back
+    std::map<const OTMLNode*, std::size_t> beforeIndex;
+    for(std::size_t i=0;i<before.size();++i)
+        beforeIndex[before[i].get()] = i;
+    std::vector<bool> keptBefore(before.size(), false);
+    std::vector<bool> keptAfter(after.size(), false);
+    std::size_t next = 0;
+    bool anyKept = false;
+    for(std::size_t i=0;i<after.size();++i) {
+        std::map<const OTMLNode*, std::size_t>::const_iterator it = beforeIndex.find(after[i].get());
+        if(it != beforeIndex.end() && it->second >= next && !detached.count(after[i].get())) {
+            keptBefore[it->second] = true;
+            keptAfter[i] = true;
+            next = it->second + 1;
+            anyKept = true;
+        }
+    }
+    if(!anyKept && !before.empty())
+        reportChange(OTMLChange::ChildrenCleared, s.node);
+    else {
+        for(std::size_t i=before.size();i-- > 0;) {
+            if(!keptBefore[i])
+                reportChange(OTMLChange::ChildRemoved, s.node, i, before[i]);
+        }
+    }
+    for(std::size_t i=0;i<after.size();++i) {
+        if(!keptAfter[i]) {
+            added.insert(after[i].get());
+            reportChange(OTMLChange::ChildAdded, s.node, i, after[i]);
+        }
+    }
+}
+
+inline void OTMLDocument::reportChange(OTMLChange::Type type, const OTMLNodePtr& node, int index, const OTMLNodePtr& child) {
+    if(m_changeListeners.empty())
+        return;
+    OTMLChange change;
+    change.type = type;
+    change.node = node;
+    change.index = index;
+    change.child = child;
+    for(std::size_t i=0;i<m_changeListeners.size();++i)
+        m_changeListeners[i]->onChange(change);
+}
+
+inline bool OTMLDocument::canAppendTo(const std::string& fileName) const {
+    return m_savedChildren >= 0 && m_savedChildren <= size() && !hasFlag(ChildrenChangedFlag) &&
+           m_sourceFile && *m_sourceFile == fileName;
+}
+
+inline bool OTMLDocument::save(const std::string& fileName, SaveMode mode, bool* written) {
+    if(written)
+        *written = false;
+    if(mode == SaveAppend && canAppendTo(fileName)) {
+        std::string data;
+        for(std::size_t i = m_savedChildren; i < m_children.size(); ++i) {
+            OTMLEmitter::emitNode(m_children[i], 0, data, emitFlags(), m_progressListener, m_cancellation);
+            data += "\n";
+        }
+        if(data.empty())
+            return true;
+        if(!otml_util::endsWithNewline(fileName))
+            data.insert(data.begin(), '\n');
+        std::ofstream fout(fileName.c_str(), std::ios::app);
+        if(fout.good()) {
+            fout << data;
+            fout.close();
+            setSaved();
+            if(written)
+                *written = true;
+            return true;
+        }
+        return false;
+    }
+
+    setSource(fileName);
+    std::string data = emit();
+    if(mode == SaveIfChanged && otml_util::fileEquals(fileName, data)) {
+        setSaved();
+        return true;
+    }
+    std::ofstream fout(fileName.c_str());
+    if(fout.good()) {
+        fout << data;
+        fout.close();
+        setSaved();
+        if(written)
+            *written = true;
+        return true;
+    }
+    return false;
+}
+
+inline bool OTMLDocument::compact(const std::string& fileName) {
+    return parse(fileName)->save(fileName, SaveIfChanged);
+}
+
+inline std::string OTMLEmitter::emitNode(const OTMLNodePtr& node, int currentDepth, int flags) {
+    std::string out;
+    emitNode(node, currentDepth, out, flags);
+    return out;
+}
+
+inline void OTMLEmitter::emitIndent(int depth, std::string& out) {
+    out.append(depth*2, ' ');
+}
+
+template<typename String>
+bool OTMLEmitter::needsQuoting(const String& value) {
+    if(value.empty())
+        return false;
+    char first = value[0];
+    char last = value[value.length()-1];
+    // a quoted value reads back the same, write() quotes strings that would lose their own quotes
+    if(value.length() > 1 && first == '"' && last == '"')
+        return false;
+    // the parser trims surrounding whitespace, starts a block at block markers,
+    // reads ~ as null and splits [a, b] into a list
+    return otml_util::isSpace(first) || otml_util::isSpace(last) ||
+           value == "|" || value == "|-" || value == "|+" || value == "~" || (first == '[' && last == ']');
+}
+
+template<typename String>
+void OTMLEmitter::emitQuoted(const String& value, std::string& out) {
+    out += '"';
+    for(std::size_t i=0;i<value.length();++i) {
+        if(value[i] == '\\' || value[i] == '"')
+            out += '\\';
+        out += value[i];
+    }
+    out += '"';
+}
+
+inline void OTMLEmitter::emitNode(const OTMLNodePtr& node, int currentDepth, std::string& out, int flags,
+                                  OTMLProgressListener* listener, const OTMLCancellationToken* cancellation) {
+    Context context;
+    context.flags = flags;
+    context.listener = listener;
+    context.cancellation = cancellation;
+    context.nodes = 0;
+    context.nextCheck = out.length() + 65536;
+    context.cacheText = NULL;
+    context.cacheStart = 0;
+    context.parentStart = 0;
+    // the cache is laid out from the children of the document at depth 0
+    if(currentDepth > 0)
+        context.flags &= ~UseCache;
+    emitNode(node, currentDepth, out, context);
+    if(listener)
+        listener->onProgress(out.length(), out.length(), context.nodes);
+}
+
+inline void OTMLEmitter::checkProgress(const OTMLNodePtr& node, const std::string& out, Context& context) {
+    context.nextCheck = out.length() + 65536;
+    if(context.cancellation && context.cancellation->isCancelled())
+        throw OTMLCancelledException(node, "emit cancelled");
+    if(context.listener)
+        context.listener->onProgress(out.length(), 0, context.nodes);
+}
+
+inline void OTMLEmitter::emitNode(const OTMLNodePtr& node, int currentDepth, std::string& out, Context& context) {
+    int flags = context.flags;
+    context.nodes++;
+    if(out.length() >= context.nextCheck)
+        checkProgress(node, out, context);
+
+    // only subtrees are cached, leaves are cheaper to emit than to copy
+    bool cacheable = (flags & UseCache) && currentDepth >= 0 && !node->m_children.empty();
+    std::size_t start = out.length();
+    const std::string* parentText = context.cacheText;
+    std::size_t parentCacheStart = context.cacheStart;
+    std::size_t parentStart = context.parentStart;
+    if(cacheable) {
+        OTMLNodeExtra* extra = node->m_extra;
+        bool cached = extra && extra->emitDepth == currentDepth;
+        if(currentDepth == 0) {
+            if(cached && node->hasFlag(OTMLNode::EmitCachedFlag)) {
+                out += extra->emitText;
+                return;
+            }
+            context.cacheText = cached ? &extra->emitText : NULL;
+            context.cacheStart = 0;
+        } else if(cached && parentText) {
+            if(node->hasFlag(OTMLNode::EmitCachedFlag)) {
+                out.append(*parentText, parentCacheStart + extra->emitOffset, extra->emitLength);
+                extra->emitOffset = start - parentStart;
+                return;
+            }
+            context.cacheStart = parentCacheStart + extra->emitOffset;
+        } else
+            context.cacheText = NULL;
+        context.parentStart = start;
+    }
+
+    // a failed emit leaves the subtree partly laid out anew, so none of its cache is kept
+    if(cacheable && currentDepth == 0) {
+        try {
+            emitNodeText(node, currentDepth, out, context);
+        } catch(...) {
+            node->dropEmitCache();
+            throw;
+        }
+    } else
+        emitNodeText(node, currentDepth, out, context);
+    context.cacheText = parentText;
+    context.cacheStart = parentCacheStart;
+    context.parentStart = parentStart;
+
+    if(cacheable) {
+        OTMLNodeExtra* extra = node->extra();
+        if(currentDepth == 0)
+            extra->emitText.assign(out, start, std::string::npos);
+        extra->emitDepth = currentDepth;
+        extra->emitOffset = start - parentStart;
+        extra->emitLength = out.length() - start;
+        node->setFlag(OTMLNode::EmitCachedFlag, true);
+    } else if(flags & UseCache) {
+        // leaves are marked without keeping their text, so writing to one or adding
+        // a child to it still invalidates the cached text of its ancestors
+        node->setFlag(OTMLNode::EmitCachedFlag, true);
+    }
+}
+
+inline void OTMLEmitter::emitNodeText(const OTMLNodePtr& node, int currentDepth, std::string& out, Context& context) {
+    int flags = context.flags;
+    if(currentDepth >= 0) {
+        emitIndent(currentDepth, out);
+        if((flags & ValidateUtf8) && !otml_util::isValidUtf8(node->m_tag.data(), node->m_tag.length()))
+            throw OTMLException(node, "tag is not valid UTF-8");
+        if(node->hasTag()) {
+            out.append(node->m_tag.data(), node->m_tag.size());
+            if(node->hasValue() || node->isUnique() || node->isNull())
+                out += ":";
+        } else
+            out += "-";
+        if(node->isNull())
+            out += " ~";
+        else if(node->hasValue()) {
+            out += " ";
+            const OTMLString& value = node->m_value;
+            // most values are plain printable ASCII, which a single vectorized scan tells apart
+            std::size_t special = otml_util::findBelow(value.data(), value.length(), 0x20);
+            if(special < value.length() && (flags & ValidateUtf8) &&
+               !otml_util::isValidUtf8(value.data() + special, value.length() - special))
+                throw OTMLException(node, "value is not valid UTF-8");
+            if(special < value.length() && value.find('\n', special) != std::string::npos) {
+                if(value.length() > 1 && value[value.length()-1] == '\n' && value[value.length()-2] == '\n')
+                    out += "|+";
+                else if(value[value.length()-1] == '\n')
+                    out += "|";
+                else
+                    out += "|-";
+                for(std::size_t pos = 0; pos < value.length(); ++pos) {
+                    out += "\n";
+                    emitIndent(currentDepth+1, out);
+                    std::size_t lineEnd = value.find('\n', pos);
+                    if(lineEnd == std::string::npos)
+                        lineEnd = value.length();
+                    out.append(value.data() + pos, lineEnd - pos);
+                    pos = lineEnd;
+                }
+            } else if(needsQuoting(value))
+                emitQuoted(value, out);
+            else
+                out.append(value.data(), value.size());
+        }
+    }
+    for(std::size_t i=0;i<node->m_children.size();++i) {
+        if(currentDepth >= 0 || i != 0)
+            out += "\n";
+        emitNode(node->m_children[i], currentDepth+1, out, context);
+    }
+}
+
+inline OTMLDocumentPtr OTMLStreamReader::next() {
+    std::string line;
+    while(in.good()) {
+        std::string* data = new std::string;
+        OTMLStringPtr record(data);
+        int firstLine = currentLine + 1;
+        while(std::getline(in, line)) {
+            currentLine++;
+            std::streamoff lineStart = position;
+            // a last line without a newline leaves the stream at its end
+            position += line.length() + (in.eof() ? 0 : 1);
+            if(isRecordMarker(line)) {
+                recordStart = lineStart;
+                break;
+            }
+            *data += line;
+            *data += "\n";
+        }
+        if(!in.good())
+            recordStart = position;
+        if(data->empty())
+            continue;
+
+        OTMLDocumentPtr doc = OTMLDocument::allocateDocument(options);
+        doc->setTag("doc");
+        doc->setSource(source);
+        OTMLParser parser(doc, record, options, firstLine);
+        parser.parse();
+        if(doc->size() > 0)
+            return doc;
+    }
+    return OTMLDocumentPtr();
+}
+
+inline void OTMLStreamReader::seek(std::streamoff offset) {
+    in.clear();
+    in.seekg(offset, std::ios::beg);
+    position = recordStart = offset;
+    currentLine = 0;
+}
+
+inline std::vector<std::streamoff> OTMLStreamReader::split(std::istream& in, int parts) {
+    in.clear();
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg();
+
+    std::vector<std::streamoff> offsets;
+    offsets.push_back(0);
+    std::string line;
+    for(int i=1;i<parts;++i) {
+        std::streamoff pos = size * i / parts;
+        if(pos <= offsets.back())
+            continue;
+        // start from the character before so a marker beginning exactly at pos is not skipped
+        in.seekg(pos - 1, std::ios::beg);
+        std::getline(in, line);
+        pos += line.length();
+        while(std::getline(in, line) && !isRecordMarker(line))
+            pos += line.length() + 1;
+        if(!in.good())
+            break;
+        if(pos > offsets.back())
+            offsets.push_back(pos);
+    }
+    if(size > offsets.back())
+        offsets.push_back(size);
+    in.clear();
+    in.seekg(0, std::ios::beg);
+    return offsets;
+}
+
+inline bool OTMLStreamReader::isRecordMarker(const std::string& line) {
+    return line.compare(0, 3, "---") == 0 && line.find_first_not_of(" \t\r", 3) == std::string::npos;
+}
+
+inline void OTMLStreamWriter::write(const OTMLNodePtr& record) {
+    std::string data = "---\n";
+    OTMLEmitter::emitNode(record, -1, data, false);
+    data += "\n";
+    out << data;
+}
+
+inline std::string OTMLSharedNode::source() const {
+    if(m_node->sourceFileLength == 0)
+        return std::string();
+    std::string file = stringAt(m_node->sourceFile, m_node->sourceFileLength);
+    if(m_node->sourceLine <= 0)
+        return file;
+    return file + ":" + otml_util::safeCast<std::string>(m_node->sourceLine);
+}
+
+inline bool OTMLSharedNode::hasChildren() const {
+    for(boost::uint32_t i=0;i<m_node->childCount;++i) {
+        if(!(m_doc->node(m_node->firstChild + i)->flags & OTMLSharedNodeData::NullFlag))
+            return true;
+    }
+    return false;
+}
+
+inline const char* OTMLSharedNode::stringData(boost::uint64_t offset) const {
+    return m_doc->m_data + m_doc->header()->stringsOffset + offset;
+}
+
+inline bool OTMLSharedNode::tagEquals(const std::string& childTag) const {
+    return m_node->tagLength == childTag.length() &&
+           std::memcmp(stringData(m_node->tag), childTag.data(), childTag.length()) == 0;
+}
+
+inline OTMLSharedNode OTMLSharedNode::get(const std::string& childTag) const {
+    for(boost::uint32_t i=0;i<m_node->childCount;++i) {
+        OTMLSharedNode child(m_doc, m_doc->node(m_node->firstChild + i));
+        if(child.tagEquals(childTag) && !child.isNull())
+            return child;
+    }
+    return OTMLSharedNode();
+}
+
+inline OTMLSharedNode OTMLSharedNode::getIndex(int childIndex) const {
+    if(childIndex < size() && childIndex >= 0)
+        return OTMLSharedNode(m_doc, m_doc->node(m_node->firstChild + childIndex));
+    return OTMLSharedNode();
+}
+
+inline OTMLSharedNode OTMLSharedNode::at(const std::string& childTag) const {
+    OTMLSharedNode res = get(childTag);
+    if(!res.isValid()) {
+        std::stringstream ss;
+        ss << "child node with tag '" << childTag << "' not found";
+        throw error(ss.str());
+    }
+    return res;
+}
+
+inline OTMLSharedNode OTMLSharedNode::atIndex(int childIndex) const {
+    if(childIndex >= size() || childIndex < 0) {
+        std::stringstream ss;
+        ss << "child node with index '" << childIndex << "' not found";
+        throw error(ss.str());
+    }
+    return OTMLSharedNode(m_doc, m_doc->node(m_node->firstChild + childIndex));
+}
+
+template<>
+inline std::string OTMLSharedNode::value() const {
+    return otml_util::unquote(rawValue());
+}
+
+template<typename T>
+T OTMLSharedNode::value() const {
+    T ret;
+    if(!otml_util::cast(rawValue(), ret))
+        throw error("failed to cast node value");
+    return ret;
+}
+
+template<typename T>
+T OTMLSharedNode::valueAt(const std::string& childTag, const T& def) const {
+    OTMLSharedNode node = get(childTag);
+    if(node.isValid())
+        return node.value<T>();
+    return def;
+}
+
+template<typename T>
+T OTMLSharedNode::valueAtIndex(int childIndex, const T& def) const {
+    OTMLSharedNode node = getIndex(childIndex);
+    if(node.isValid())
+        return node.value<T>();
+    return def;
+}
+
+inline OTMLNodePtr OTMLSharedNode::toNode() const {
+    OTMLStringPtr sourceFile;
+    boost::uint64_t sourceFileOffset = 0;
+    return toNode(sourceFile, sourceFileOffset);
+}
+
+inline OTMLNodePtr OTMLSharedNode::toNode(OTMLStringPtr& sourceFile, boost::uint64_t& sourceFileOffset) const {
+    OTMLNodePtr node = OTMLNode::create(tag(), isUnique());
+    node->setValue(rawValue());
+    node->setNull(isNull());
+    // nodes of a document almost always share the same file, keep reusing the last one
+    if(m_node->sourceFileLength > 0) {
+        if(!sourceFile || sourceFileOffset != m_node->sourceFile) {
+            sourceFile.reset(new std::string(stringAt(m_node->sourceFile, m_node->sourceFileLength)));
+            sourceFileOffset = m_node->sourceFile;
+        }
+        node->setSource(sourceFile, m_node->sourceLine);
+    }
+    for(boost::uint32_t i=0;i<m_node->childCount;++i)
+        node->addChild(OTMLSharedNode(m_doc, m_doc->node(m_node->firstChild + i)).toNode(sourceFile, sourceFileOffset));
+    return node;
+}
+
+inline OTMLException OTMLSharedNode::error(const std::string& error) const {
+    std::stringstream ss;
+    ss << "OTML error";
+    if(!source().empty())
+        ss << " in '" << source() << "'";
+    ss << ": " << error;
+    return OTMLException(ss.str());
+}
+
+inline OTMLSharedDocument::OTMLSharedDocument(const char* data, std::size_t size, bool mapped) :
+    m_data(data), m_size(size), m_mapped(mapped) { }
+
+inline OTMLSharedDocument::~OTMLSharedDocument() {
+#ifdef OTML_SHARED_MEMORY
+    if(m_mapped)
+        munmap(const_cast<char*>(m_data), m_size);
+#endif
+}
+
+inline std::string OTMLSharedDocument::createImage(const OTMLNodePtr& doc) {
+    std::vector<OTMLSharedNodeData> nodes;
+    std::string strings;
+    std::map<std::string, boost::uint64_t> interned;
+
+    // breadth first, so the children of every node end up next to each other
+    OTMLNodeList order;
+    order.push_back(doc);
+    for(std::size_t i = 0; i < order.size(); ++i) {
+        OTMLNodePtr node = order[i];
+        std::string fields[3] = { node->tag(), node->rawValue(), node->sourceFile() ? *node->sourceFile() : std::string() };
+        boost::uint64_t offsets[3];
+        for(int f=0;f<3;++f) {
+            std::map<std::string, boost::uint64_t>::iterator it = interned.find(fields[f]);
+            if(it == interned.end()) {
+                it = interned.insert(std::make_pair(fields[f], (boost::uint64_t)strings.length())).first;
+                strings += fields[f];
+            }
+            offsets[f] = it->second;
+        }
+
+        OTMLSharedNodeData data;
+        data.tag = offsets[0];
+        data.value = offsets[1];
+        data.sourceFile = offsets[2];
+        data.tagLength = fields[0].length();
+        data.valueLength = fields[1].length();
+        data.sourceFileLength = fields[2].length();
+        data.firstChild = order.size();
+        data.childCount = node->size();
+        data.sourceLine = node->sourceLine();
+        data.flags = (node->isUnique() ? OTMLSharedNodeData::UniqueFlag : 0) |
+                     (node->isNull() ? OTMLSharedNodeData::NullFlag : 0);
+        data.reserved = 0;
+        nodes.push_back(data);
+
+        for(int c=0;c<node->size();++c)
+            order.push_back(node->atIndex(c));
+    }
+
+    OTMLSharedHeader header;
+    std::memcpy(header.magic, "OTMLSHM", 8);
+    header.version = 1;
+    header.nodeCount = nodes.size();
+    header.nodesOffset = sizeof(OTMLSharedHeader);
+    header.stringsOffset = header.nodesOffset + nodes.size() * sizeof(OTMLSharedNodeData);
+    header.size = header.stringsOffset + strings.length();
+
+    std::string image;
+    image.reserve(header.size);
+    image.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    image.append(reinterpret_cast<const char*>(&nodes[0]), nodes.size() * sizeof(OTMLSharedNodeData));
+    image += strings;
+    return image;
+}
+
+inline void OTMLSharedDocument::checkImage(const char* data, std::size_t size, const std::string& name) {
+    const OTMLSharedHeader* header = reinterpret_cast<const OTMLSharedHeader*>(data);
+    bool valid = size >= sizeof(OTMLSharedHeader) && std::memcmp(header->magic, "OTMLSHM", 8) == 0 && header->version == 1 &&
+                 header->size <= size && header->nodeCount > 0 && header->nodesOffset == sizeof(OTMLSharedHeader) &&
+                 header->stringsOffset == header->nodesOffset + header->nodeCount * sizeof(OTMLSharedNodeData) &&
+                 header->stringsOffset <= header->size;
+
+    // every reference is checked once here, so node accessors can follow them without bounds checks,
+    // children always come after their parent, which also rules out cycles
+    if(valid) {
+        const OTMLSharedNodeData* nodes = reinterpret_cast<const OTMLSharedNodeData*>(data + header->nodesOffset);
+        boost::uint64_t stringsSize = header->size - header->stringsOffset;
+        for(boost::uint32_t i=0;valid && i<header->nodeCount;++i) {
+            const OTMLSharedNodeData& node = nodes[i];
+            valid = (node.childCount == 0 || node.firstChild > i) &&
+                    (boost::uint64_t)node.firstChild + node.childCount <= header->nodeCount &&
+                    node.tag <= stringsSize && node.tagLength <= stringsSize - node.tag &&
+                    node.value <= stringsSize && node.valueLength <= stringsSize - node.value &&
+                    node.sourceFile <= stringsSize && node.sourceFileLength <= stringsSize - node.sourceFile;
+        }
+    }
+    if(!valid) {
+        std::stringstream ss;
+        ss << "invalid shared document image " << name;
+        throw OTMLException(ss.str());
+    }
+}
+
+inline OTMLSharedDocumentPtr OTMLSharedDocument::fromImage(const char* data, std::size_t size) {
+    checkImage(data, size, "");
+    return OTMLSharedDocumentPtr(new OTMLSharedDocument(data, size, false));
+}
+
+inline OTMLDocumentPtr OTMLSharedDocument::toDocument() const {
+    OTMLDocumentPtr doc = OTMLDocument::create();
+    OTMLSharedNode node = root();
+    doc->setTag(node.tag());
+    doc->setSource(node.source());
+    for(int i=0;i<node.size();++i)
+        doc->addChild(node.atIndex(i).toNode());
+    return doc;
+}
+
+#ifdef OTML_SHARED_MEMORY
+inline void OTMLSharedDocument::publish(const OTMLNodePtr& doc, const std::string& name) {
+    std::string image = createImage(doc);
+
+    // a new segment is created instead of overwriting the old one in place, attached readers are unaffected
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0) {
+        std::stringstream ss;
+        ss << "failed to create shared memory segment " << name << ": " << std::strerror(errno);
+        throw OTMLException(ss.str());
+    }
+    void* p = MAP_FAILED;
+    if(ftruncate(fd, image.length()) == 0)
+        p = mmap(NULL, image.length(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        int err = errno;
+        shm_unlink(name.c_str());
+        std::stringstream ss;
+        ss << "failed to map shared memory segment " << name << ": " << std::strerror(err);
+        throw OTMLException(ss.str());
+    }
+
+    const std::size_t magicSize = sizeof(OTMLSharedHeader().magic);
+    // the magic goes in last, so attaching to a segment still being written fails its check
+    char* data = static_cast<char*>(p);
+    std::memcpy(data + magicSize, image.data() + magicSize, image.length() - magicSize);
+#ifdef __GNUC__
+    __sync_synchronize();
+#endif
+    std::memcpy(data, image.data(), magicSize);
+    munmap(p, image.length());
+}
+
+inline OTMLSharedDocumentPtr OTMLSharedDocument::attach(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if(fd < 0) {
+        std::stringstream ss;
+        ss << "failed to open shared memory segment " << name << ": " << std::strerror(errno);
+        throw OTMLException(ss.str());
+    }
+    struct stat st;
+    void* p = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        std::stringstream ss;
+        ss << "failed to map shared memory segment " << name;
+        throw OTMLException(ss.str());
+    }
+
+    const char* data = static_cast<const char*>(p);
+    try {
+        checkImage(data, st.st_size, name);
+    } catch(...) {
+        munmap(p, st.st_size);
+        throw;
+    }
+    return OTMLSharedDocumentPtr(new OTMLSharedDocument(data, st.st_size, true));
+}
+
+inline bool OTMLSharedDocument::unpublish(const std::string& name) {
+    return shm_unlink(name.c_str()) == 0;
+}
+#endif
+
+inline void OTMLOverlay::addLayer(const OTMLNodePtr& layer) {
+    m_layers.push_back(layer);
+    invalidate();
+}
+
+inline void OTMLOverlay::invalidate() {
+    m_childrenResolved = false;
+    m_entries.clear();
+    m_children.clear();
+    m_lookups.clear();
+}
+
+inline bool OTMLOverlay::hasChildren() const {
+    for(OTMLNodeList::const_iterator it = m_layers.begin(), end = m_layers.end(); it != end; ++it) {
+        if((*it)->hasChildren())
+            return true;
+    }
+    return false;
+}
+
+// what replacing this child with layer would give in OTMLNode::addChild, subtrees
+// are only merged when both sides have children, otherwise the new layer hides the old ones
+inline OTMLOverlayPtr OTMLOverlay::stack(const OTMLNodePtr& layer) const {
+    OTMLOverlayPtr overlay(new OTMLOverlay(true));
+    if(hasChildren() && layer->hasChildren())
+        overlay->m_layers = m_layers;
+    overlay->m_layers.push_back(layer);
+    return overlay;
+}
+
+inline OTMLOverlayPtr OTMLOverlay::get(const std::string& childTag) {
+    std::map<std::string, OTMLOverlayPtr>::iterator cached = m_lookups.find(childTag);
+    if(cached != m_lookups.end())
+        return cached->second;
+
+    OTMLOverlayPtr res;
+    if(m_childrenResolved) {
+        for(OTMLOverlayList::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
+            if((*it)->tag() == childTag) {
+                res = *it;
+                break;
+            }
+        }
+    } else {
+        // fold the children with the tag bottom-up, without resolving the other children
+        for(OTMLNodeList::iterator it = m_layers.begin(), end = m_layers.end(); it != end; ++it) {
+            const OTMLNodePtr& layer = *it;
+            for(int i=0;i<layer->size();++i) {
+                OTMLNodePtr child = layer->atIndex(i);
+                if(child->tag() != childTag)
+                    continue;
+                if(!res) {
+                    res = OTMLOverlayPtr(new OTMLOverlay(false));
+                    res->m_layers.push_back(child);
+                } else if(res->isUnique() || child->isUnique())
+                    res = res->stack(child);
+            }
+        }
+        if(res && res->isNull())
+            res.reset();
+    }
+    m_lookups[childTag] = res;
+    return res;
+}
+
+inline OTMLOverlayPtr OTMLOverlay::getIndex(int childIndex) {
+    resolveChildren();
+    if(childIndex < (int)m_entries.size() && childIndex >= 0)
+        return m_entries[childIndex];
+    return OTMLOverlayPtr();
+}
+
+inline OTMLOverlayPtr OTMLOverlay::at(const std::string& childTag) {
+    OTMLOverlayPtr res = get(childTag);
+    if(!res) {
+        std::stringstream ss;
+        ss << "child node with tag '" << childTag << "' not found";
+        throw OTMLException(top(), ss.str());
+    }
+    return res;
+}
+
+inline OTMLOverlayPtr OTMLOverlay::atIndex(int childIndex) {
+    OTMLOverlayPtr res = getIndex(childIndex);
+    if(!res) {
+        std::stringstream ss;
+        ss << "child node with index '" << childIndex << "' not found";
+        throw OTMLException(top(), ss.str());
+    }
+    return res;
+}
+
+inline void OTMLOverlay::resolveChildren() {
+    if(m_childrenResolved)
+        return;
+
+    // replays OTMLNode::addChild for the children of every layer, bottom-up
+    OTMLOverlayList& entries = m_entries;
+    for(OTMLNodeList::iterator it = m_layers.begin(), end = m_layers.end(); it != end; ++it) {
+        const OTMLNodePtr& layer = *it;
+        for(int i=0;i<layer->size();++i) {
+            OTMLNodePtr child = layer->atIndex(i);
+            bool replaced = false;
+            if(child->hasTag()) {
+                for(std::size_t j=0;j<entries.size();++j) {
+                    if(entries[j]->tag() == child->tag() && (entries[j]->isUnique() || child->isUnique())) {
+                        entries[j] = entries[j]->stack(child);
+                        for(std::size_t k=entries.size();k-->0;) {
+                            if(k != j && entries[k]->tag() == child->tag()) {
+                                entries.erase(entries.begin() + k);
+                                if(k < j)
+                                    j--;
+                            }
+                        }
+                        replaced = true;
+                        break;
+                    }
+                }
+            }
+            if(!replaced) {
+                OTMLOverlayPtr entry(new OTMLOverlay(false));
+                entry->m_layers.push_back(child);
+                entries.push_back(entry);
+            }
+        }
+    }
+
+    for(OTMLOverlayList::iterator it = entries.begin(), end = entries.end(); it != end; ++it) {
+        if(!(*it)->isNull())
+            m_children.push_back(*it);
+    }
+    m_childrenResolved = true;
+}
+
+template<typename T>
+T OTMLOverlay::valueAt(const std::string& childTag, const T& def) {
+    if(OTMLOverlayPtr node = get(childTag))
+        return node->value<T>();
+    return def;
+}
+
+template<typename T>
+T OTMLOverlay::valueAtIndex(int childIndex, const T& def) {
+    if(OTMLOverlayPtr node = getIndex(childIndex))
+        return node->value<T>();
+    return def;
+}
+
+inline OTMLNodePtr OTMLOverlay::materialize() {
+    OTMLNodePtr node = OTMLNode::create(tag(), isUnique());
+    node->setValue(rawValue());
+    node->setNull(isNull());
+    node->setSource(top()->sourceFile(), top()->sourceLine());
+    resolveChildren();
+    for(OTMLOverlayList::const_iterator it = m_entries.begin(), end = m_entries.end(); it != end; ++it)
+        node->addChild((*it)->materialize());
+    return node;
+}
+
+inline void OTMLColumn::addRow() {
+    if(m_size % 64 == 0)
+        m_presence.push_back(0);
+    switch(m_type) {
+    case IntColumn:
+        m_ints.push_back(0);
+        break;
+    case DoubleColumn:
+        m_doubles.push_back(0);
+        break;
+    case BoolColumn:
+        m_bools.push_back(0);
+        break;
+    case StringColumn:
+        if(m_strings.empty()) {
+            m_strings.push_back(std::string());
+            m_interned[std::string()] = 0;
+        }
+        m_stringIds.push_back(0);
+        break;
+    }
+    m_size++;
+}
+
+inline void OTMLColumn::removeRow(std::size_t stringCount) {
+    m_size--;
+    if(m_size % 64 == 0)
+        m_presence.pop_back();
+    else
+        m_presence[m_size / 64] &= ~((boost::uint64_t)1 << (m_size % 64));
+    switch(m_type) {
+    case IntColumn:
+        m_ints.pop_back();
+        break;
+    case DoubleColumn:
+        m_doubles.pop_back();
+        break;
+    case BoolColumn:
+        m_bools.pop_back();
+        break;
+    case StringColumn:
+        m_stringIds.pop_back();
+        while(m_strings.size() > stringCount) {
+            m_interned.erase(m_strings.back());
+            m_strings.pop_back();
+        }
+        break;
+    }
+}
+
+inline void OTMLColumn::set(const OTMLNodePtr& node) {
+    std::size_t row = m_size - 1;
+    switch(m_type) {
+    case IntColumn:
+        m_ints[row] = node->value<long>();
+        break;
+    case DoubleColumn:
+        m_doubles[row] = node->value<double>();
+        break;
+    case BoolColumn:
+        m_bools[row] = node->value<bool>();
+        break;
+    case StringColumn: {
+        const OTMLString& raw = node->m_value;
+        // only quoted values need unescaping, other values are looked up as they are stored
+        std::string value;
+        if(!raw.empty() && raw[0] == '"')
+            value = node->value<std::string>();
+        else
+            value.assign(raw.data(), raw.size());
+        std::map<std::string, boost::uint32_t>::iterator it = m_interned.find(value);
+        if(it == m_interned.end()) {
+            it = m_interned.insert(std::make_pair(value, (boost::uint32_t)m_strings.size())).first;
+            m_strings.push_back(value);
+        }
+        m_stringIds[row] = it->second;
+        break;
+    }
+    }
+    m_presence[row / 64] |= (boost::uint64_t)1 << (row % 64);
+}
+
+inline void OTMLColumns::addColumn(const std::string& field, OTMLColumn::Type type) {
+    OTMLColumn column(field, type);
+    for(std::size_t i=0;i<m_rows;++i)
+        column.addRow();
+    m_columns.push_back(column);
+}
+
+inline void OTMLColumns::extract(const OTMLNodePtr& list) {
+    int columns = m_columns.size();
+    std::vector<std::size_t> stringCounts(columns);
+    for(int r=0;r<list->size();++r) {
+        const OTMLNodePtr& record = list->m_children[r];
+        if(record->isNull())
+            continue;
+        for(int c=0;c<columns;++c) {
+            stringCounts[c] = m_columns[c].m_strings.size();
+            m_columns[c].addRow();
+        }
+
+        // fields are matched on the raw tag, the first occurrence of a field wins like in get()
+        try {
+            for(int f=0;f<record->size();++f) {
+                const OTMLNodePtr& field = record->m_children[f];
+                if(field->isNull())
+                    continue;
+                const OTMLString& tag = field->m_tag;
+                for(int c=0;c<columns;++c) {
+                    OTMLColumn& column = m_columns[c];
+                    if(column.m_field.size() == tag.size() && std::memcmp(column.m_field.data(), tag.data(), tag.size()) == 0) {
+                        if(!column.has(m_rows))
+                            column.set(field);
+                        break;
+                    }
+                }
+            }
+        } catch(...) {
+            // the row is only counted once all its fields converted, a half filled one is dropped
+            for(int c=0;c<columns;++c)
+                m_columns[c].removeRow(stringCounts[c]);
+            throw;
+        }
+        m_rows++;
+    }
+}
+
+inline const OTMLColumn& OTMLColumns::column(const std::string& field) const {
+    for(std::size_t i=0;i<m_columns.size();++i) {
+        if(m_columns[i].field() == field)
+            return m_columns[i];
+    }
+    std::stringstream ss;
+    ss << "no column for field '" << field << "'";
+    throw OTMLException(ss.str());
+}
+
+inline void OTMLPathView::refresh() {
+    // changes made since the previous refresh are stamped with its generation or a later one
+    if(m_generation && m_root->m_changeStamp < m_generation)
+        return;
+    boost::uint64_t since = m_generation;
+    m_generation = ++otml_util::changeGeneration();
+    index(std::string(), m_root, since);
+}
+
+// re-indexes a node whose subtree changed, children still indexed at the same path and not
+// changed since the previous refresh are skipped
+inline void OTMLPathView::index(const std::string& path, const OTMLNodePtr& node, boost::uint64_t since) {
+    std::vector<std::string> oldChildren;
+    {
+        Entry& entry = m_paths[path];
+        entry.node = node;
+        oldChildren.swap(entry.children);
+    }
+    node->setFlag(OTMLNode::IndexedFlag, true);
+
+    std::vector<std::string> children;
+    PathSet seen;
+    for(int i=0;i<node->size();++i) {
+        const OTMLNodePtr& child = node->m_children[i];
+        if(child->isNull())
+            continue;
+        std::string childPath = path;
+        if(!childPath.empty())
+            childPath += '/';
+        if(child->hasTag())
+            childPath.append(child->m_tag.data(), child->m_tag.size());
+        else
+            childPath += otml_util::safeCast<std::string>(i);
+        if(!seen.insert(childPath).second)
+            continue;
+        children.push_back(childPath);
+
+        PathMap::iterator it = m_paths.find(childPath);
+        if(it != m_paths.end()) {
+            if(it->second.node == child && child->m_changeStamp < since)
+                continue;
+            if(it->second.node != child)
+                erase(childPath);
+        }
+        index(childPath, child, since);
+    }
+
+    for(std::size_t i=0;i<oldChildren.size();++i) {
+        if(!seen.count(oldChildren[i]))
+            erase(oldChildren[i]);
+    }
+
+    m_paths[path].children.swap(children);
+}
+
+inline void OTMLPathView::erase(const std::string& path) {
+    PathMap::iterator it = m_paths.find(path);
+    if(it == m_paths.end())
+        return;
+    std::vector<std::string> children;
+    children.swap(it->second.children);
+    m_paths.erase(it);
+    for(std::size_t i=0;i<children.size();++i)
+        erase(children[i]);
+}
+
+inline OTMLNodePtr OTMLPathView::get(const std::string& path) {
+    refresh();
+    PathMap::const_iterator it = m_paths.find(path);
+    if(it == m_paths.end())
+        return OTMLNodePtr();
+    return it->second.node;
+}
+
+inline OTMLNodePtr OTMLPathView::at(const std::string& path) {
+    OTMLNodePtr node = get(path);
+    if(!node) {
+        std::stringstream ss;
+        ss << "node with path '" << path << "' not found";
+        throw OTMLException(m_root, ss.str());
+    }
+    return node;
+}
+
+template<typename T>
+T OTMLPathView::valueAt(const std::string& path, const T& def) {
+    if(OTMLNodePtr node = get(path))
+        return node->value<T>();
+    return def;
+}
+
+inline OTMLNodePtr OTMLPathWriter::resolve(const std::string& path) {
+    // checked first so a bad path leaves the tree untouched
+    if(!otml_util::isTagPath(path))
+        throw OTMLException(m_root, "invalid path '" + path + "'");
+    std::size_t slash = path.find_last_of('/');
+    if(slash == std::string::npos)
+        return m_root->resolveChild(path);
+    return resolveParent(path.substr(0, slash))->resolveChild(path.substr(slash + 1));
+}
+
+inline OTMLNodePtr OTMLPathWriter::resolveParent(const std::string& path) {
+    NodeMap::const_iterator it = m_nodes.find(path);
+    if(it != m_nodes.end() && isInPlace(it->second.get(), path))
+        return it->second;
+
+    std::size_t slash = path.find_last_of('/');
+    OTMLNodePtr node;
+    if(slash == std::string::npos)
+        node = m_root->resolveChild(path);
+    else
+        node = resolveParent(path.substr(0, slash))->resolveChild(path.substr(slash + 1));
+    m_nodes[path] = node;
+    return node;
+}
+
+// whether the node still hangs from the root through nodes tagged like the path, none of them null
+inline bool OTMLPathWriter::isInPlace(const OTMLNode* node, const std::string& path) const {
+    std::size_t end = path.length();
+    for(;;) {
+        std::size_t slash = path.rfind('/', end - 1);
+        std::size_t begin = slash == std::string::npos ? 0 : slash + 1;
+        if(node->isNull() || path.compare(begin, end - begin, node->m_tag.data(), node->m_tag.size()) != 0)
+            return false;
+        node = node->m_parent.lock().get();
+        if(slash == std::string::npos)
+            return node == m_root.get();
+        if(!node)
+            return false;
+        end = slash;
+    }
+}
+
+inline OTMLShardedDocument::OTMLShardedDocument(const std::string& manifestFile, const OTMLParseOptions& options) :
+    m_manifestFile(manifestFile), m_options(options) {
+    std::size_t slash = manifestFile.find_last_of('/');
+    if(slash != std::string::npos)
+        m_directory = manifestFile.substr(0, slash + 1);
+}
+
+inline std::string OTMLShardedDocument::shardFileName(const std::string& manifestFile, int shard, bool alternate) {
+    std::size_t slash = manifestFile.find_last_of('/');
+    std::string name = slash == std::string::npos ? manifestFile : manifestFile.substr(slash + 1);
+    std::size_t dot = name.find_last_of('.');
+    std::string index = otml_util::safeCast<std::string>(shard);
+    if(alternate)
+        index += 'b';
+    if(dot == std::string::npos || dot == 0)
+        return name + "." + index;
+    return name.substr(0, dot) + "." + index + name.substr(dot);
+}
+
+inline bool OTMLShardedDocument::writeFile(const std::string& fileName, const std::string& data) {
+    if(otml_util::fileEquals(fileName, data))
+        return true;
+    std::ofstream fout(fileName.c_str());
+    if(!fout.good())
+        return false;
+    fout << data;
+    fout.close();
+    return fout.good();
+}
+
+// a shard alternates between two file names and is written to the one the manifest on disk does
+// not list, so the files it lists stay intact until the new manifest replaces it
+inline bool OTMLShardedDocument::writeShard(const std::string& directory, const std::string& manifestFile, int shard,
+                                            const std::set<std::string>& listed, const std::string& data, std::string& file) {
+    std::string names[2] = { shardFileName(manifestFile, shard), shardFileName(manifestFile, shard, true) };
+    for(int i=0;i<2;++i) {
+        if(listed.count(names[i]) && otml_util::fileEquals(directory + names[i], data)) {
+            file = names[i];
+            return true;
+        }
+    }
+    for(int i=0;i<2;++i) {
+        if(!listed.count(names[i])) {
+            file = names[i];
+            return writeFile(directory + file, data);
+        }
+    }
+    return false;
+}
+
+inline bool OTMLShardedDocument::writeManifest(const std::string& manifestFile, const std::vector<Shard>& shards,
+                                               const std::vector<Entry>& entries) {
+    // emitted a shard at a time, adding them all to a document would compare every pair of tags
+    std::string data;
+    for(std::size_t i=0;i<shards.size();++i) {
+        const Shard& shard = shards[i];
+        OTMLNodePtr shardNode = OTMLNode::create("shard");
+        shardNode->writeAt("file", shard.file);
+        OTMLNodePtr nodes = OTMLNode::create("nodes");
+        for(int j = shard.first; j < shard.first + shard.count; ++j)
+            nodes->writeIn(entries[j].tag);
+        shardNode->addChild(nodes);
+        OTMLEmitter::emitNode(shardNode, 0, data, 0);
+        data += "\n";
+    }
+    if(otml_util::fileEquals(manifestFile, data))
+        return true;
+    // written aside and renamed over the old one, so readers see either manifest whole
+    std::string tempFile = manifestFile + ".tmp";
+    if(!writeFile(tempFile, data))
+        return false;
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows, the old manifest is removed first,
+    // so a reader opening it right then finds none and has to retry
+    std::remove(manifestFile.c_str());
+#endif
+    return std::rename(tempFile.c_str(), manifestFile.c_str()) == 0;
+}
+
+inline void OTMLShardedDocument::listedFiles(const std::string& manifestFile, std::set<std::string>& files) {
+    if(!std::ifstream(manifestFile.c_str()).good())
+        return;
+    try {
+        OTMLDocumentPtr manifest = OTMLDocument::parse(manifestFile);
+        for(int i=0;i<manifest->size();++i)
+            files.insert(manifest->atIndex(i)->valueAt<std::string>("file", std::string()));
+    } catch(OTMLException&) {
+        // nothing can be read through a broken manifest, its files may be overwritten
+    }
+}
+
+// removes the files the replaced manifest listed that the new one does not, files it did not
+// list are left alone even when named like shards
+inline void OTMLShardedDocument::removeStaleShards(const std::string& directory, const std::set<std::string>& listed,
+                                                   const std::vector<Shard>& shards) {
+    std::set<std::string> kept;
+    for(std::size_t i=0;i<shards.size();++i)
+        kept.insert(shards[i].file);
+    for(std::set<std::string>::const_iterator it = listed.begin(), end = listed.end(); it != end; ++it) {
+        if(!it->empty() && !kept.count(*it))
+            std::remove((directory + *it).c_str());
+    }
+}
+
+inline bool OTMLShardedDocument::save(const OTMLDocumentPtr& doc, const std::string& manifestFile, std::size_t maxShardBytes) {
+    std::string directory;
+    std::size_t slash = manifestFile.find_last_of('/');
+    if(slash != std::string::npos)
+        directory = manifestFile.substr(0, slash + 1);
+
+    std::set<std::string> listed;
+    listedFiles(manifestFile, listed);
+
+    std::vector<Shard> shards;
+    std::vector<Entry> entries;
+    std::string data;
+    std::string text;
+    bool ok = true;
+    for(int i=0;i<=doc->size();++i) {
+        if(i < doc->size()) {
+            const OTMLNodePtr& child = doc->m_children[i];
+            text.clear();
+            OTMLEmitter::emitNode(child, 0, text, doc->emitFlags(), doc->m_progressListener, doc->m_cancellation);
+            text += "\n";
+        }
+        // the pending shard is written once the next node no longer fits in it
+        if(!shards.empty() && (i == doc->size() || maxShardBytes == 0 || data.length() + text.length() > maxShardBytes)) {
+            ok = writeShard(directory, manifestFile, shards.size() - 1, listed, data, shards.back().file) && ok;
+            data.clear();
+        }
+        if(i == doc->size())
+            break;
+        if(data.empty()) {
+            Shard shard;
+            shard.first = i;
+            shard.count = 0;
+            shards.push_back(shard);
+        }
+        data += text;
+        shards.back().count++;
+
+        Entry entry;
+        entry.tag = doc->m_children[i]->tag();
+        entry.shard = shards.size() - 1;
+        entries.push_back(entry);
     }
-    ss << ": "  << error;
-    m_what = ss.str();
+    // a manifest listing a shard that failed to write would not load
+    if(!ok || !writeManifest(manifestFile, shards, entries))
+        return false;
+    removeStaleShards(directory, listed, shards);
+    return true;
 }
 
-inline OTMLNodePtr OTMLNode::create(std::string tag, bool unique) {
-    OTMLNodePtr node(new OTMLNode);
-    node->setTag(tag);
-    node->setUnique(unique);
-    return node;
+inline OTMLShardedDocumentPtr OTMLShardedDocument::open(const std::string& manifestFile, const OTMLParseOptions& options) {
+    OTMLDocumentPtr manifest = OTMLDocument::parse(manifestFile, options);
+    OTMLShardedDocumentPtr sharded(new OTMLShardedDocument(manifestFile, options));
+    for(int i=0;i<manifest->size();++i) {
+        OTMLNodePtr shardNode = manifest->atIndex(i);
+        if(shardNode->tag() != "shard")
+            throw OTMLException(shardNode, "expected a shard in the manifest");
+        OTMLNodePtr nodes = shardNode->at("nodes");
+
+        Shard shard;
+        shard.file = shardNode->valueAt<std::string>("file");
+        shard.first = sharded->m_entries.size();
+        shard.count = nodes->size();
+        sharded->m_shards.push_back(shard);
+
+        for(int j=0;j<nodes->size();++j) {
+            Entry entry;
+            entry.tag = nodes->atIndex(j)->value<std::string>();
+            entry.shard = i;
+            sharded->m_entries.push_back(entry);
+        }
+    }
+    return sharded;
 }
 
-inline OTMLNodePtr OTMLNode::create(std::string tag, std::string value) {
-    OTMLNodePtr node(new OTMLNode);
-    node->setTag(tag);
-    node->setValue(value);
-    node->setUnique(true);
-    return node;
+inline void OTMLShardedDocument::loadShard(int shard) {
+    Shard& s = m_shards[shard];
+    if(s.doc)
+        return;
+    OTMLDocumentPtr doc = OTMLDocument::parse(m_directory + s.file, m_options);
+    if(doc->size() != s.count)
+        throw OTMLException(doc, "shard does not match the manifest");
+    // the parsed tags are authoritative, the manifest only locates them
+    for(int i=0;i<s.count;++i)
+        m_entries[s.first + i].tag = doc->atIndex(i)->tag();
+    s.doc = doc;
 }
 
-inline bool OTMLNode::hasChildren() const {
-    int count = 0;
-    for(OTMLNodeList::const_iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
-        const OTMLNodePtr& child = *it;
-        if(!child->isNull())
-            count++;
-    }
-    return count > 0;
+inline OTMLNodePtr OTMLShardedDocument::node(int childIndex) {
+    const Entry& entry = m_entries[childIndex];
+    loadShard(entry.shard);
+    const Shard& shard = m_shards[entry.shard];
+    return shard.doc->getIndex(childIndex - shard.first);
 }
 
-inline OTMLNodePtr OTMLNode::get(const std::string& childTag) const {
-    for(OTMLNodeList::const_iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
-        const OTMLNodePtr& child = *it;
-        if(child->tag() == childTag && !child->isNull())
+inline OTMLNodePtr OTMLShardedDocument::get(const std::string& childTag) {
+    for(int i=0;i<size();++i) {
+        if(m_entries[i].tag != childTag)
+            continue;
+        OTMLNodePtr child = node(i);
+        // the tag read from the manifest may change once the shard is parsed
+        if(child && child->tag() == childTag && !child->isNull())
             return child;
     }
     return OTMLNodePtr();
 }
 
-inline OTMLNodePtr OTMLNode::getIndex(int childIndex) const {
+inline OTMLNodePtr OTMLShardedDocument::getIndex(int childIndex) {
     if(childIndex < size() && childIndex >= 0)
-        return m_children[childIndex];
+        return node(childIndex);
     return OTMLNodePtr();
 }
 
-inline OTMLNodePtr OTMLNode::at(const std::string& childTag) {
-    OTMLNodePtr res;
-    for(OTMLNodeList::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
-        const OTMLNodePtr& child = *it;
-        if(child->tag() == childTag && !child->isNull()) {
-            res = child;
-            break;
-        }
-    }
+inline OTMLNodePtr OTMLShardedDocument::at(const std::string& childTag) {
+    OTMLNodePtr res = get(childTag);
     if(!res) {
         std::stringstream ss;
-        ss << "child node with tag '" << childTag << "' not found";
-        throw OTMLException(shared_from_this(), ss.str());
+        ss << "child node with tag '" << childTag << "' not found in " << m_manifestFile;
+        throw OTMLException(ss.str());
     }
     return res;
 }
 
-inline OTMLNodePtr OTMLNode::atIndex(int childIndex) {
-    if(childIndex >= size() || childIndex < 0) {
+inline OTMLNodePtr OTMLShardedDocument::atIndex(int childIndex) {
+    OTMLNodePtr res = getIndex(childIndex);
+    if(!res) {
         std::stringstream ss;
-        ss << "child node with index '" << childIndex << "' not found";
-        throw OTMLException(shared_from_this(), ss.str());
+        ss << "child node with index '" << childIndex << "' not found in " << m_manifestFile;
+        throw OTMLException(ss.str());
     }
-    return m_children[childIndex];
+    return res;
 }
 
-inline void OTMLNode::addChild(const OTMLNodePtr& newChild) {
-    if(newChild->hasTag()) {
-        for(OTMLNodeList::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
-            const OTMLNodePtr& node = *it;
-            if(node->tag() == newChild->tag() && (node->isUnique() || newChild->isUnique())) {
-                newChild->setUnique(true);
-
-                if(node->hasChildren() && newChild->hasChildren()) {
-                    OTMLNodePtr tmpNode = node->clone();
-                    tmpNode->merge(newChild);
-                    newChild->copy(tmpNode);
-                }
+template<typename T>
+T OTMLShardedDocument::valueAt(const std::string& childTag, const T& def) {
+    if(OTMLNodePtr node = get(childTag))
+        return node->value<T>();
+    return def;
+}
 
-                replaceChild(node, newChild);
-                OTMLNodeList::iterator it = m_children.begin();
-                while(it != m_children.end()) {
-                    OTMLNodePtr node = (*it);
-                    if(node != newChild && node->tag() == newChild->tag()) {
-                        node->setParent(OTMLNodePtr());
-                        it = m_children.erase(it);
-                    } else
-                        ++it;
-                }
-                return;
-            }
-        }
-    }
-    m_children.push_back(newChild);
-    newChild->setParent(shared_from_this());
+template<typename T>
+T OTMLShardedDocument::valueAtIndex(int childIndex, const T& def) {
+    if(OTMLNodePtr node = getIndex(childIndex))
+        return node->value<T>();
+    return def;
 }
 
-inline bool OTMLNode::removeChild(const OTMLNodePtr& oldChild) {
-    OTMLNodeList::iterator it = std::find(m_children.begin(), m_children.end(), oldChild);
-    if(it != m_children.end()) {
-        m_children.erase(it);
-        oldChild->setParent(OTMLNodePtr());
-        return true;
+inline OTMLNodeList OTMLShardedDocument::children() {
+    OTMLNodeList children;
+    for(int i=0;i<size();++i) {
+        OTMLNodePtr child = node(i);
+        if(child && !child->isNull())
+            children.push_back(child);
     }
-    return false;
+    return children;
 }
 
-inline bool OTMLNode::replaceChild(const OTMLNodePtr& oldChild, const OTMLNodePtr& newChild) {
-    OTMLNodeList::iterator it = std::find(m_children.begin(), m_children.end(), oldChild);
-    if(it != m_children.end()) {
-        oldChild->setParent(OTMLNodePtr());
-        newChild->setParent(shared_from_this());
-        it = m_children.erase(it);
-        m_children.insert(it, newChild);
-        return true;
+inline OTMLDocumentPtr OTMLShardedDocument::toDocument() {
+    OTMLDocumentPtr doc = OTMLDocument::create();
+    for(int i=0;i<size();++i) {
+        if(OTMLNodePtr child = node(i))
+            doc->addChild(child->clone());
     }
-    return false;
+    return doc;
 }
 
-inline void OTMLNode::copy(const OTMLNodePtr& node)
-{
-    setTag(node->tag());
-    setValue(node->rawValue());
-    setUnique(node->isUnique());
-    setNull(node->isNull());
-    setSource(node->source());
-    clear();
-    for(OTMLNodeList::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
-        const OTMLNodePtr& child = *it;
-        addChild(child->clone());
+inline bool OTMLShardedDocument::save() {
+    std::set<std::string> listed;
+    for(std::size_t i=0;i<m_shards.size();++i)
+        listed.insert(m_shards[i].file);
+
+    bool ok = true;
+    std::vector<Shard> shards = m_shards;
+    std::vector<Entry> entries;
+    for(std::size_t i=0;i<shards.size();++i) {
+        Shard& shard = shards[i];
+        int first = entries.size();
+        if(shard.doc) {
+            ok = writeShard(m_directory, m_manifestFile, i, listed, shard.doc->emit(), shard.file) && ok;
+            for(int j=0;j<shard.doc->size();++j) {
+                Entry entry;
+                entry.tag = shard.doc->atIndex(j)->tag();
+                entry.shard = i;
+                entries.push_back(entry);
+            }
+        } else
+            entries.insert(entries.end(), m_entries.begin() + shard.first, m_entries.begin() + shard.first + shard.count);
+        shard.first = first;
+        shard.count = entries.size() - first;
     }
-}
+    if(!ok || !writeManifest(m_manifestFile, shards, entries))
+        return false;
 
-inline void OTMLNode::merge(const OTMLNodePtr& node) {
-    for(OTMLNodeList::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
-        const OTMLNodePtr& child = *it;
-        addChild(child->clone());
+    m_shards.swap(shards);
+    m_entries.swap(entries);
+    for(std::size_t i=0;i<m_shards.size();++i) {
+        Shard& shard = m_shards[i];
+        if(shard.doc) {
+            shard.doc->setSource(m_directory + shard.file);
+            shard.doc->setSaved();
+        }
     }
-    setTag(node->tag());
-    setSource(node->source());
+    removeStaleShards(m_directory, listed, m_shards);
+    return true;
 }
 
-inline void OTMLNode::clear() {
-    for(OTMLNodeList::iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
-        const OTMLNodePtr& child = *it;
-        child->setParent(OTMLNodePtr());
+inline void OTMLPatchLog::writeNumber(std::string& out, boost::uint64_t value) {
+    // 7 bits per byte, the high bit tells that more bytes follow
+    while(value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
     }
-    m_children.clear();
+    out += (char)value;
 }
 
-inline OTMLNodeList OTMLNode::children() const {
-    OTMLNodeList children;
-    for(OTMLNodeList::const_iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
-        const OTMLNodePtr& child = *it;
-        if(!child->isNull())
-            children.push_back(child);
-    }
-    return children;
+inline void OTMLPatchLog::writeString(std::string& out, const char* data, std::size_t length) {
+    writeNumber(out, length);
+    out.append(data, length);
 }
 
-inline OTMLNodePtr OTMLNode::clone() const {
-    OTMLNodePtr myClone(new OTMLNode);
-    myClone->setTag(m_tag);
-    myClone->setValue(m_value);
-    myClone->setUnique(m_unique);
-    myClone->setNull(m_null);
-    myClone->setSource(m_source);
-    for(OTMLNodeList::const_iterator it = m_children.begin(), end = m_children.end(); it != end; ++it) {
-        const OTMLNodePtr& child = *it;
-        myClone->addChild(child->clone());
-    }
-    return myClone;
+inline void OTMLPatchLog::writeNode(std::string& out, const OTMLNodePtr& node) {
+    writeString(out, node->m_tag.data(), node->m_tag.size());
+    writeString(out, node->m_value.data(), node->m_value.size());
+    writeNumber(out, flagsOf(node.get()));
+    writeNumber(out, node->m_children.size());
+    for(OTMLNodeStorage::iterator it = node->m_children.begin(), end = node->m_children.end(); it != end; ++it)
+        writeNode(out, *it);
 }
 
-inline std::string OTMLNode::emit() {
-    return OTMLEmitter::emitNode(shared_from_this(), 0);
+inline void OTMLPatchLog::writePath(const OTMLNode* node) {
+    std::vector<int> path;
+    while(OTMLNode* parent = node->m_parent.lock().get()) {
+        // searched from the end, where children are usually added
+        const OTMLNodeStorage& siblings = parent->m_children;
+        int index = siblings.size() - 1;
+        while(index >= 0 && siblings[index].get() != node)
+            --index;
+        path.push_back(index);
+        node = parent;
+    }
+    writeNumber(m_data, path.size());
+    for(std::size_t i = path.size(); i-- > 0;)
+        writeNumber(m_data, path[i]);
 }
 
-template<>
-inline std::string OTMLNode::value() {
-    std::string value = m_value;
-    if(boost::starts_with(value, "\"") && boost::ends_with(value, "\"")) {
-        value = value.substr(1, value.length()-2);
-        boost::replace_all(value, "\\\\", "\\");
-        boost::replace_all(value, "\\\"", "\"");
-        boost::replace_all(value, "\\t",  "\t");
-        boost::replace_all(value, "\\n",  "\n");
-        boost::replace_all(value, "\\'",  "\'");
+inline void OTMLPatchLog::onChange(const OTMLChange& change) {
+    const OTMLNodePtr& node = change.node;
+    switch(change.type) {
+    case OTMLChange::TagChanged:
+        m_data += (char)SetTagOp;
+        writePath(node.get());
+        writeString(m_data, node->m_tag.data(), node->m_tag.size());
+        break;
+    case OTMLChange::ValueChanged:
+        m_data += (char)SetValueOp;
+        writePath(node.get());
+        writeString(m_data, node->m_value.data(), node->m_value.size());
+        break;
+    case OTMLChange::FlagsChanged:
+        m_data += (char)SetFlagsOp;
+        writePath(node.get());
+        writeNumber(m_data, flagsOf(node.get()));
+        break;
+    case OTMLChange::ChildAdded:
+        m_data += (char)InsertOp;
+        writePath(node.get());
+        writeNumber(m_data, change.index);
+        writeNode(m_data, change.child);
+        break;
+    case OTMLChange::ChildRemoved:
+        m_data += (char)RemoveOp;
+        writePath(node.get());
+        writeNumber(m_data, change.index);
+        break;
+    case OTMLChange::ChildrenCleared:
+        m_data += (char)ClearOp;
+        writePath(node.get());
+        break;
     }
-    return value;
 }
 
-template<typename T>
-T OTMLNode::value() {
-    T ret;
-    if(!otml_util::cast(m_value, ret))
-        throw OTMLException(shared_from_this(), "failed to cast node value");
-    return ret;
+inline boost::uint64_t OTMLPatchLog::Reader::number() {
+    boost::uint64_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        if(pos >= data.length())
+            break;
+        unsigned char byte = data[pos++];
+        value |= (boost::uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return value;
+    }
+    throw OTMLException("malformed patch");
 }
 
-template<typename T>
-T OTMLNode::valueAt(const std::string& childTag) {
-    OTMLNodePtr node = at(childTag);
-    return node->value<T>();
+inline std::string OTMLPatchLog::Reader::string() {
+    boost::uint64_t length = number();
+    if(length > data.length() - pos)
+        throw OTMLException("malformed patch");
+    std::string value = data.substr(pos, length);
+    pos += length;
+    return value;
 }
 
-template<typename T>
-T OTMLNode::valueAtIndex(int childIndex) {
-    OTMLNodePtr node = atIndex(childIndex);
-    return node->value<T>();
+inline OTMLNodePtr OTMLPatchLog::Reader::node(const OTMLNodePtr& parent, int depth) {
+    if(depth > 1000)
+        throw OTMLException("malformed patch");
+    OTMLNodePtr node = parent->createChild();
+    std::string tag = string();
+    std::string value = string();
+    node->m_tag.assign(tag.data(), tag.size());
+    node->m_value.assign(value.data(), value.size());
+    boost::uint64_t flags = number();
+    node->setFlag(OTMLNode::UniqueFlag, (flags & 1) != 0);
+    node->setFlag(OTMLNode::NullFlag, (flags & 2) != 0);
+    // appended as is, the children were already deduplicated on the recorded side
+    boost::uint64_t count = number();
+    // each child takes at least 4 bytes
+    if(count > (data.length() - pos) / 4)
+        throw OTMLException("malformed patch");
+    for(boost::uint64_t i=0;i<count;++i) {
+        OTMLNodePtr child = this->node(node, depth + 1);
+        node->m_children.push_back(child);
+        child->m_parent = node;
+    }
+    return node;
 }
 
-template<typename T>
-T OTMLNode::valueAt(const std::string& childTag, const T& def) {
-    if(OTMLNodePtr node = get(childTag))
-        if(!node->isNull())
-            return node->value<T>();
-    return def;
+inline OTMLNodePtr OTMLPatchLog::resolve(const OTMLNodePtr& root, Reader& reader) {
+    OTMLNodePtr node = root;
+    boost::uint64_t depth = reader.number();
+    for(boost::uint64_t i=0;i<depth;++i) {
+        boost::uint64_t index = reader.number();
+        if(index >= node->m_children.size())
+            throw OTMLException(root, "patch does not match the document");
+        node = node->m_children[index];
+    }
+    return node;
 }
 
-template<typename T>
-T OTMLNode::valueAtIndex(int childIndex, const T& def) {
-    if(OTMLNodePtr node = getIndex(childIndex))
-        return node->value<T>();
-    return def;
+inline void OTMLPatchLog::apply(const OTMLNodePtr& root, const std::string& patch) {
+    Reader reader(patch);
+    while(!reader.atEnd()) {
+        boost::uint64_t op = reader.number();
+        OTMLNodePtr node = resolve(root, reader);
+        switch(op) {
+        case SetTagOp:
+            node->setTag(reader.string());
+            break;
+        case SetValueOp:
+            node->setValue(reader.string());
+            break;
+        case SetFlagsOp: {
+            boost::uint64_t flags = reader.number();
+            node->setUnique((flags & 1) != 0);
+            node->setNull((flags & 2) != 0);
+            break;
+        }
+        case InsertOp: {
+            boost::uint64_t index = reader.number();
+            if(index > node->m_children.size())
+                throw OTMLException(root, "patch does not match the document");
+            OTMLNodePtr child = reader.node(node, 0);
+            node->touch();
+            node->m_children.insert(node->m_children.begin() + index, child);
+            child->m_parent = node;
+            node->markDirty();
+            node->notify(OTMLChange::ChildAdded, index, child);
+            break;
+        }
+        case RemoveOp: {
+            boost::uint64_t index = reader.number();
+            if(index >= node->m_children.size())
+                throw OTMLException(root, "patch does not match the document");
+            OTMLNodePtr child = node->m_children[index];
+            node->touch();
+            node->m_children.erase(node->m_children.begin() + index);
+            child->m_parent.reset();
+            node->setFlag(OTMLNode::ChildrenChangedFlag, true);
+            node->markDirty();
+            node->notify(OTMLChange::ChildRemoved, index, child);
+            break;
+        }
+        case ClearOp:
+            node->clear();
+            break;
+        default:
+            throw OTMLException("malformed patch");
+        }
+    }
 }
 
-template<typename T>
-void OTMLNode::write(const T& v) {
-    m_value = otml_util::safeCast<std::string>(v);
+inline void OTMLObservers::subscribe(const OTMLNodePtr& node, OTMLObserver* observer, bool subtree) {
+    if(m_subscriptions.empty())
+        m_doc->addChangeListener(this);
+    Subscription subscription;
+    subscription.node = node;
+    subscription.observer = observer;
+    subscription.subtree = subtree;
+    m_subscriptions.insert(std::make_pair(node.get(), subscription));
 }
 
-template<typename T>
-void OTMLNode::writeAt(const std::string& childTag, const T& v) {
-    OTMLNodePtr child = OTMLNode::create(childTag);
-    child->setUnique(true);
-    child->write<T>(v);
-    addChild(child);
+inline void OTMLObservers::unsubscribe(const OTMLNodePtr& node, OTMLObserver* observer) {
+    std::pair<SubscriptionMap::iterator, SubscriptionMap::iterator> range = m_subscriptions.equal_range(node.get());
+    for(SubscriptionMap::iterator it = range.first; it != range.second;) {
+        if(it->second.observer == observer)
+            m_subscriptions.erase(it++);
+        else
+            ++it;
+    }
+    if(m_subscriptions.empty())
+        m_doc->removeChangeListener(this);
 }
 
-template<typename T>
-void OTMLNode::writeIn(const T& v) {
-    OTMLNodePtr child = OTMLNode::create();
-    child->write<T>(v);
-    addChild(child);
+inline void OTMLObservers::endBatch() {
+    if(--m_batchDepth == 0)
+        deliver();
 }
 
-inline OTMLDocumentPtr OTMLDocument::create() {
-    OTMLDocumentPtr doc(new OTMLDocument);
-    doc->setTag("doc");
-    return doc;
+inline OTMLNodeChanges& OTMLObservers::changesOf(const OTMLNodePtr& node) {
+    std::map<const OTMLNode*, std::size_t>::iterator it = m_pendingIndex.find(node.get());
+    if(it != m_pendingIndex.end())
+        return m_pending[it->second];
+    m_pendingIndex[node.get()] = m_pending.size();
+    m_pending.push_back(OTMLNodeChanges());
+    m_pending.back().node = node;
+    return m_pending.back();
 }
 
-inline OTMLDocumentPtr OTMLDocument::parse(const std::string& fileName) {
-    std::ifstream fin(fileName.c_str());
-    if(!fin.good()) {
-        std::stringstream ss;
-        ss << "failed to open file " << fileName;
-        throw OTMLException(ss.str());
+inline void OTMLObservers::onChange(const OTMLChange& change) {
+    OTMLNodeChanges& changes = changesOf(change.node);
+    switch(change.type) {
+    case OTMLChange::TagChanged:
+        changes.tagChanged = true;
+        break;
+    case OTMLChange::ValueChanged:
+        changes.valueChanged = true;
+        break;
+    case OTMLChange::FlagsChanged:
+        changes.flagsChanged = true;
+        break;
+    case OTMLChange::ChildAdded: {
+        OTMLNodeList::iterator it = std::find(changes.removed.begin(), changes.removed.end(), change.child);
+        if(it != changes.removed.end())
+            changes.removed.erase(it);
+        else
+            changes.added.push_back(change.child);
+        break;
+    }
+    case OTMLChange::ChildRemoved: {
+        OTMLNodeList::iterator it = std::find(changes.added.begin(), changes.added.end(), change.child);
+        if(it != changes.added.end())
+            changes.added.erase(it);
+        else
+            changes.removed.push_back(change.child);
+        break;
+    }
+    case OTMLChange::ChildrenCleared:
+        changes.added.clear();
+        changes.cleared = true;
+        break;
     }
-    return parse(fin, fileName);
+    if(m_batchDepth == 0)
+        deliver();
 }
 
-inline OTMLDocumentPtr OTMLDocument::parse(std::istream& in, const std::string& source) {
-    OTMLDocumentPtr doc(new OTMLDocument);
-    doc->setSource(source);
-    OTMLParser parser(doc, in);
-    parser.parse();
-    return doc;
+inline void OTMLObservers::deliver() {
+    // changes made by observers while being notified are delivered in a following round
+    if(m_delivering)
+        return;
+    m_delivering = true;
+    try {
+        while(!m_pending.empty())
+            deliverPending();
+    } catch(...) {
+        m_delivering = false;
+        throw;
+    }
+    m_delivering = false;
 }
 
-inline std::string OTMLDocument::emit() {
-    return OTMLEmitter::emitNode(shared_from_this()) + "\n";
-}
+inline void OTMLObservers::deliverPending() {
+    OTMLChangeSet pending;
+    pending.swap(m_pending);
+    m_pendingIndex.clear();
 
-inline bool OTMLDocument::save(const std::string& fileName) {
-    m_source = fileName;
-    std::ofstream fout(fileName.c_str());
-    if(fout.good()) {
-        fout << emit();
-        fout.close();
-        return true;
+    std::vector<std::pair<OTMLObserver*, OTMLChangeSet> > deliveries;
+    std::map<OTMLObserver*, std::size_t> deliveryIndex;
+    for(OTMLChangeSet::iterator it = pending.begin(), end = pending.end(); it != end; ++it) {
+        const OTMLNodeChanges& changes = *it;
+        // the node's own observers, then those of its ancestors watching their subtree
+        bool own = true;
+        for(OTMLNodePtr node = changes.node; node; node = node->parent(), own = false) {
+            std::pair<SubscriptionMap::iterator, SubscriptionMap::iterator> range = m_subscriptions.equal_range(node.get());
+            for(SubscriptionMap::iterator sub = range.first; sub != range.second; ++sub) {
+                if(!own && !sub->second.subtree)
+                    continue;
+                OTMLObserver* observer = sub->second.observer;
+                std::map<OTMLObserver*, std::size_t>::iterator found = deliveryIndex.find(observer);
+                if(found == deliveryIndex.end()) {
+                    found = deliveryIndex.insert(std::make_pair(observer, deliveries.size())).first;
+                    deliveries.push_back(std::make_pair(observer, OTMLChangeSet()));
+                }
+                OTMLChangeSet& set = deliveries[found->second].second;
+                if(set.empty() || set.back().node != changes.node)
+                    set.push_back(changes);
+            }
+        }
     }
-    return false;
+
+    for(std::size_t i=0;i<deliveries.size();++i)
+        deliveries[i].first->onChanges(deliveries[i].second);
 }
 
-inline std::string OTMLEmitter::emitNode(const OTMLNodePtr& node, int currentDepth) {
-    std::stringstream ss;
-    if(currentDepth >= 0) {
-        for(int i=0;i<currentDepth;++i)
-            ss << "  ";
-        if(node->hasTag()) {
-            ss << node->tag();
-            if(node->hasValue() || node->isUnique() || node->isNull())
-                ss << ":";
-        } else
-            ss << "-";
-        if(node->isNull())
-            ss << " ~";
-        else if(node->hasValue()) {
-            ss << " ";
-            std::string value = node->rawValue();
-            if(value.find("\n") != std::string::npos) {
-                if(value[value.length()-1] == '\n' && value[value.length()-2] == '\n')
-                    ss << "|+";
-                else if(value[value.length()-1] == '\n')
-                    ss << "|";
-                else
-                    ss << "|-";
-                for(std::size_t pos = 0; pos < value.length(); ++pos) {
-                    ss << "\n";
-                    for(int i=0;i<currentDepth+1;++i)
-                        ss << "  ";
-                    while(pos < value.length()) {
-                        if(value[pos] == '\n')
-                            break;
-                        ss << value[pos++];
-                    }
-                }
-            } else
-                ss << value;
+inline void OTMLParser::parse() {
+    if(!buffer) {
+        if(!in->good())
+            throw OTMLException(doc, "cannot read from input stream");
+        readInput();
+    } else if(options.maxBytes > 0 && buffer->length() > options.maxBytes)
+        throw OTMLLimitException(doc, "input exceeds the maximum size");
+    if(options.validateUtf8) {
+        std::size_t errorPos;
+        if(!otml_util::isValidUtf8(buffer->data(), buffer->length(), &errorPos)) {
+            int line = currentLine + 1 + std::count(buffer->begin(), buffer->begin() + errorPos, '\n');
+            throw OTMLException(doc, "invalid UTF-8 sequence", line);
         }
     }
-    for(int i=0;i<node->size();++i) {
-        if(currentDepth >= 0 || i != 0)
-            ss << "\n";
-        ss << emitNode(node->atIndex(i), currentDepth+1);
+    while(!atEnd)
+        parseLine(getNextLine());
+    reportProgress();
+}
+
+inline void OTMLParser::readInput() {
+    std::string* data = new std::string;
+    buffer.reset(data);
+    char chunk[65536];
+    while(in->read(chunk, sizeof(chunk)) || in->gcount() > 0) {
+        data->append(chunk, in->gcount());
+        if(options.maxBytes > 0 && data->length() > options.maxBytes)
+            throw OTMLLimitException(doc, "input exceeds the maximum size");
+        if(options.cancellation && options.cancellation->isCancelled())
+            throw OTMLCancelledException(doc, "parse cancelled");
+        if(options.progressListener)
+            options.progressListener->onProgress(data->length(), 0, 0);
     }
-    return ss.str();
 }
 
-inline void OTMLParser::parse() {
-    if(!in.good())
-        throw OTMLException(doc, "cannot read from input stream");
-    while(!in.eof())
-        parseLine(getNextLine());
+inline void OTMLParser::reportProgress() {
+    if(options.cancellation && options.cancellation->isCancelled())
+        throw OTMLCancelledException(doc, "parse cancelled", currentLine);
+    if(options.progressListener)
+        options.progressListener->onProgress(pos, buffer->length(), nodeCount);
 }
 
-inline std::string OTMLParser::getNextLine() {
+inline const otml_util::LineInfo& OTMLParser::getNextLine() {
     currentLine++;
-    std::string line;
-    std::getline(in, line);
+    if(lineIndex >= lines.size() || lines[lineIndex].begin != pos) {
+        if(pos > 0)
+            reportProgress();
+        lines.clear();
+        lineIndex = 0;
+        otml_util::scanLines(buffer->data(), pos, buffer->length(), lines);
+    }
+    const otml_util::LineInfo& line = lines[lineIndex++];
+    if(options.maxLineLength > 0 && line.end - line.begin > options.maxLineLength)
+        throw OTMLLimitException(doc, "line exceeds the maximum length", currentLine);
+    // like std::getline, a trailing newline is followed by one last empty line
+    if(line.end >= buffer->length())
+        atEnd = true;
+    pos = std::min(line.end + 1, buffer->length());
     return line;
 }
 
-inline int OTMLParser::getLineDepth(const std::string& line, bool multilining) {
-    std::size_t spaces = 0;
-    while(line[spaces] == ' ')
-        spaces++;
-
+inline int OTMLParser::getLineDepth(const otml_util::LineInfo& line, bool multilining) {
+    std::size_t spaces = line.spaces;
     int depth = spaces / 2;
     if(!multilining || depth <= currentDepth) {
-        if(line[spaces] == '\t')
+        if(line.begin + spaces < line.end && (*buffer)[line.begin + spaces] == '\t')
             throw OTMLException(doc, "indentation with tabs are not allowed", currentLine);
         if(spaces % 2 != 0)
             throw OTMLException(doc, "must indent every 2 spaces", currentLine);
@@ -643,30 +4795,44 @@ inline int OTMLParser::getLineDepth(const std::string& line, bool multilining) {
     return depth;
 }
 
-inline void OTMLParser::parseLine(std::string line) {
+inline bool OTMLParser::isBlankLine(const otml_util::LineInfo& line) {
+    for(std::size_t i = line.begin + line.spaces; i < line.end; ++i) {
+        if(!otml_util::isSpace((*buffer)[i]))
+            return false;
+    }
+    return true;
+}
+
+inline void OTMLParser::parseLine(const otml_util::LineInfo& line) {
     int depth = getLineDepth(line);
     if(depth == -1)
         return;
-    boost::trim(line);
-    if(line.empty())
+    const std::string& data = *buffer;
+    std::size_t first = line.begin + line.spaces;
+    std::size_t last = line.end;
+    while(first < last && otml_util::isSpace(data[first]))
+        first++;
+    while(last > first && otml_util::isSpace(data[last-1]))
+        last--;
+    if(first == last)
         return;
-    if(line.substr(0, 2) == "//")
+    if(last - first >= 2 && data.compare(first, 2, "//") == 0)
         return;
-    if(depth == currentDepth+1) {
-        currentParent = previousNode;
+    if(depth == currentDepth+1 && previousNode) {
+        if(options.maxDepth > 0 && (std::size_t)depth >= options.maxDepth)
+            throw OTMLLimitException(doc, "nesting exceeds the maximum depth", currentLine);
+        parents.push_back(previousNode);
     } else if(depth < currentDepth) {
-        for(int i=0;i<currentDepth-depth;++i)
-            currentParent = currentParent->parent();
+        parents.resize(depth+1);
     } else if(depth != currentDepth)
         throw OTMLException(doc, "invalid indentation depth, are you indenting correctly?", currentLine);
     currentDepth = depth;
-    parseNode(line);
+    parseNode(data.substr(first, last - first), line.colon == std::string::npos ? std::string::npos : line.colon - first);
 }
 
-inline void OTMLParser::parseNode(const std::string& data) {
+inline void OTMLParser::parseNode(const std::string& data, std::size_t dotsPos) {
     std::string tag;
     std::string value;
-    std::size_t dotsPos = data.find_first_of(':');
     int nodeLine = currentLine;
     if(!data.empty() && data[0] == '-') {
         value = data.substr(1);
@@ -680,46 +4846,40 @@ inline void OTMLParser::parseNode(const std::string& data) {
     }
     boost::trim(tag);
     boost::trim(value);
+    if(++nodeCount > options.maxNodes && options.maxNodes > 0)
+        throw OTMLLimitException(doc, "document exceeds the maximum number of nodes", nodeLine);
+    OTMLNodePtr node = doc->createChild(tag, dotsPos != std::string::npos);
+    if(options.trackSource)
+        node->setSource(doc->sourceFile(), nodeLine);
     if(value == "|" || value == "|-" || value == "|+") {
-        std::string multiLineData;
+        // find where the block ends first, its lines are then de-indented straight into the value
+        std::size_t blockBegin = pos;
         do {
-            size_t lastPos = in.tellg();
-            std::string line = getNextLine();
+            std::size_t lastPos = pos;
+            const otml_util::LineInfo& line = getNextLine();
             int depth = getLineDepth(line, true);
-            if(depth > currentDepth) {
-                multiLineData += line.substr((currentDepth+1)*2);
-            } else {
-                boost::trim(line);
-                if(!line.empty()) {
-                    in.seekg(lastPos, std::ios::beg);
-                    currentLine--;
-                    break;
-                }
+            if(depth <= currentDepth && !isBlankLine(line)) {
+                pos = lastPos;
+                atEnd = false;
+                lineIndex--;
+                currentLine--;
+                break;
             }
-            multiLineData += "\n";
-        } while(!in.eof());
-        if(value == "|" || value == "|-") {
-            int lastPos = multiLineData.length();
-            while(multiLineData[--lastPos] == '\n')
-                multiLineData.erase(lastPos, 1);
-
-            if(value == "|")
-                multiLineData.append("\n");
-        }
-        value = multiLineData;
-    }
-    OTMLNodePtr node = OTMLNode::create(tag);
-    node->setUnique(dotsPos != std::string::npos);
-    node->setTag(tag);
-    node->setSource(doc->source() + ":" + otml_util::safeCast<std::string>(nodeLine));
-    if(value == "~")
+        } while(!atEnd);
+        node->setBlockValue(*buffer, blockBegin, pos, (currentDepth+1)*2, value.length() > 1 ? value[1] : 0, atEnd);
+    } else if(value == "~")
         node->setNull(true);
     else {
         if(boost::starts_with(value, "[") && boost::ends_with(value, "]")) {
             typedef boost::tokenizer<boost::escaped_list_separator<char> > Tokenizer;
             std::string tmp = value.substr(1, value.length()-2);
             Tokenizer tok(tmp);
+            std::size_t count = 0;
             for(Tokenizer::iterator it = tok.begin(), end = tok.end(); it != end; ++it) {
+                if(options.maxListLength > 0 && ++count > options.maxListLength)
+                    throw OTMLLimitException(doc, "list exceeds the maximum length", nodeLine);
+                if(++nodeCount > options.maxNodes && options.maxNodes > 0)
+                    throw OTMLLimitException(doc, "document exceeds the maximum number of nodes", nodeLine);
                 std::string v = *it;
                 boost::trim(v);
                 node->writeIn(v);
@@ -728,8 +4888,8 @@ inline void OTMLParser::parseNode(const std::string& data) {
             node->setValue(value);
     }
 
-    currentParent->addChild(node);
-    previousNode = node;
+    parents.back()->addChild(node);
+    previousNode = node.get();
 }
 
 #endif
@@ -1,6 +1,29 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <sys/stat.h>
+#include <utime.h>
 #include "otml.h"
 
+int failures = 0;
+
+void check(bool condition, const std::string& what)
+{
+    if(!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+OTMLDocumentPtr parseText(const std::string& text, const OTMLParseOptions& options = OTMLParseOptions())
+{
+    std::istringstream in(text);
+    return OTMLDocument::parse(in, "text", options);
+}
+
 void testWrite(const std::string& filename)
 {
     OTMLDocumentPtr doc = OTMLDocument::create();
@@ -21,9 +44,802 @@ void testRead(const std::string& filename)
     std::cout << doc->emit() << std::endl;
 }
 
+void testEmitCache()
+{
+    OTMLDocumentPtr doc = OTMLDocument::create();
+    OTMLNodePtr group = OTMLNode::create("group", true);
+    group->writeAt("a", 1);
+    group->writeAt("b", 2);
+    doc->addChild(group);
+    doc->setEmitCaching(true);
+    doc->emit();
+
+    // edits below a cached subtree must show in the next emit
+    group->at("b")->write(42);
+    check(doc->emit().find("b: 42") != std::string::npos, "emit cache after a leaf write");
+    group->at("a")->writeAt("c", 3);
+    check(doc->emit().find("c: 3") != std::string::npos, "emit cache after a child added to a leaf");
+    group->at("b")->setTag("d");
+    check(doc->emit().find("d: 42") != std::string::npos, "emit cache after a tag change");
+
+    // cached subtrees moved elsewhere or put back after an emit are laid out again
+    OTMLDocumentPtr tree = parseText("a\n  b\n    c: 1\n    d: 2\n  e\n    f: 3\ng\n  h\n    i: 4\n");
+    tree->setEmitCaching(true);
+    tree->emit();
+    OTMLNodePtr b = tree->at("a")->at("b");
+    tree->at("a")->removeChild(b);
+    tree->at("g")->addChild(b);
+    tree->at("a")->at("e")->writeAt("j", 5);
+    std::string plain;
+    OTMLEmitter::emitNode(tree, -1, plain, 0);
+    check(tree->emit() == plain + "\n", "emit cache after a subtree moved");
+    OTMLNodePtr e = tree->at("a")->at("e");
+    tree->at("a")->removeChild(e);
+    tree->emit();
+    tree->at("a")->addChild(e);
+    e->at("f")->write(6);
+    plain.clear();
+    OTMLEmitter::emitNode(tree, -1, plain, 0);
+    check(tree->emit() == plain + "\n", "emit cache after a subtree put back");
+}
+
+time_t modificationTime(const std::string& filename)
+{
+    struct stat info;
+    return stat(filename.c_str(), &info) == 0 ? info.st_mtime : 0;
+}
+
+void setModificationTime(const std::string& filename, time_t time)
+{
+    struct utimbuf times;
+    times.actime = time;
+    times.modtime = time;
+    utime(filename.c_str(), &times);
+}
+
+void testSaveIfChanged(const std::string& filename)
+{
+    OTMLDocumentPtr doc = parseText("a: 1\nb: 2\n");
+    check(doc->save(filename), "save before saving if changed");
+
+    // a file already holding the content is not written, which the old modification time shows
+    const time_t old = 1000000000;
+    setModificationTime(filename, old);
+    bool written = true;
+    check(doc->save(filename, OTMLDocument::SaveIfChanged, &written) && !written, "unchanged save reports nothing written");
+    check(modificationTime(filename) == old, "unchanged save leaves the file alone");
+
+    doc->writeAt("b", 3);
+    check(doc->save(filename, OTMLDocument::SaveIfChanged, &written) && written, "changed save reports the file written");
+    check(modificationTime(filename) != old && OTMLDocument::parse(filename)->valueAt<int>("b") == 3, "changed save rewrites the file");
+
+    // compact drops the entries superseded by later ones and leaves a compact file alone
+    {
+        std::ofstream fout(filename.c_str());
+        fout << "a: 1\nb: 2\na: 3\n";
+    }
+    check(OTMLDocument::compact(filename), "compact");
+    std::ifstream fin(filename.c_str());
+    std::stringstream compacted;
+    compacted << fin.rdbuf();
+    check(compacted.str() == "a: 3\nb: 2\n", "compacted file content");
+    setModificationTime(filename, old);
+    check(OTMLDocument::compact(filename) && modificationTime(filename) == old, "compact leaves a compact file alone");
+}
+
+void testSaveAppend(const std::string& filename)
+{
+    // the file lacks a trailing newline, appended entries must start on a line of their own
+    {
+        std::ofstream fout(filename.c_str());
+        fout << "a: 1";
+    }
+    OTMLDocumentPtr doc = OTMLDocument::parse(filename);
+    doc->writeAt("b", 2);
+    bool written = false;
+    doc->save(filename, OTMLDocument::SaveAppend, &written);
+    check(written && OTMLDocument::parse(filename)->emit() == doc->emit(), "append after a missing newline");
+
+    // edits to entries already in the file need a full write
+    doc->at("a")->write(10);
+    doc->writeAt("c", 3);
+    doc->save(filename, OTMLDocument::SaveAppend);
+    check(OTMLDocument::parse(filename)->emit() == doc->emit(), "append after editing a saved entry");
+
+    doc->at("b")->writeAt("d", 4);
+    doc->save(filename, OTMLDocument::SaveAppend);
+    check(OTMLDocument::parse(filename)->emit() == doc->emit(), "append after adding below a saved entry");
+
+    doc->writeAt("e", 5);
+    doc->save(filename, OTMLDocument::SaveAppend);
+    check(OTMLDocument::parse(filename)->emit() == doc->emit(), "append after a full write");
+}
+
+void testStreamRecords()
+{
+    std::ostringstream out;
+    OTMLStreamWriter writer(out);
+    for(int i = 0; i < 20; ++i) {
+        OTMLNodePtr record = OTMLNode::create("record");
+        record->writeAt("id", i);
+        record->writeAt("name", std::string(i % 7 + 1, 'x'));
+        writer.write(record);
+    }
+    const std::string text = out.str();
+
+    std::istringstream in(text);
+    OTMLStreamReader reader(in, "stream");
+    int count = 0;
+    while(OTMLDocumentPtr record = reader.next()) {
+        check(record->valueAt<int>("id") == count, "stream record read in order");
+        count++;
+    }
+    check(count == 20 && reader.tell() == (std::streamoff)text.length(), "stream read to the end");
+
+    // every record is read exactly once by the readers of the ranges split() gives
+    std::vector<std::streamoff> offsets = OTMLStreamReader::split(in, 4);
+    check(offsets.size() > 2 && offsets.front() == 0 && offsets.back() == (std::streamoff)text.length(), "stream split offsets");
+    std::vector<int> ids;
+    for(std::size_t i = 0; i + 1 < offsets.size(); ++i) {
+        OTMLStreamReader part(in, "stream");
+        part.seek(offsets[i]);
+        while(part.tell() < offsets[i + 1]) {
+            OTMLDocumentPtr record = part.next();
+            if(!record)
+                break;
+            ids.push_back(record->valueAt<int>("id"));
+        }
+    }
+    bool inOrder = ids.size() == 20;
+    for(std::size_t i = 0; i < ids.size(); ++i)
+        inOrder = inOrder && ids[i] == (int)i;
+    check(inOrder, "stream split ranges read every record once");
+
+    // a last line without a newline ends the stream where the text ends
+    const std::string unterminated = text.substr(0, text.length() - 1);
+    std::istringstream last(unterminated);
+    OTMLStreamReader lastReader(last, "stream");
+    count = 0;
+    while(lastReader.next())
+        count++;
+    check(count == 20 && lastReader.tell() == (std::streamoff)unterminated.length(), "stream offset after a last line without newline");
+}
+
+bool sameLines(const std::vector<otml_util::LineInfo>& a, const std::vector<otml_util::LineInfo>& b)
+{
+    if(a.size() != b.size())
+        return false;
+    for(std::size_t i = 0; i < a.size(); ++i) {
+        if(a[i].begin != b[i].begin || a[i].end != b[i].end || a[i].spaces != b[i].spaces || a[i].colon != b[i].colon)
+            return false;
+    }
+    return true;
+}
+
+void testScanLines()
+{
+    // line ends fall on every offset around the 16 and 32 byte boundaries
+    std::string text;
+    for(int length = 0; length < 70; ++length) {
+        std::string line(length % 9, ' ');
+        if(length % 5 == 0)
+            line += '\t';
+        while(line.length() < (std::size_t)length)
+            line += line.length() % 7 == 3 ? ':' : 'x';
+        if(length % 4 == 0)
+            line += '\r';
+        text += line + "\n";
+    }
+    text += "  last: line without newline";
+
+    for(std::size_t begin = 0; begin < 40; begin += 13) {
+        std::vector<otml_util::LineInfo> scalar;
+        otml_util::scanLines(text.data(), begin, text.length(), scalar, otml_util::scanBlockScalar);
+        std::size_t newlines = std::count(text.begin() + begin, text.end(), '\n');
+        check(scalar.size() == newlines + 1 && scalar.back().end == text.length(), "scalar line scan");
+#ifdef OTML_SIMD_X86
+        std::vector<otml_util::LineInfo> sse2;
+        otml_util::scanLines(text.data(), begin, text.length(), sse2, otml_util::scanBlockSSE2);
+        check(sameLines(scalar, sse2), "SSE2 line scan matches the scalar one");
+        if(otml_util::simdLevel() == otml_util::SimdAVX2) {
+            std::vector<otml_util::LineInfo> avx2;
+            otml_util::scanLines(text.data(), begin, text.length(), avx2, otml_util::scanBlockAVX2);
+            check(sameLines(scalar, avx2), "AVX2 line scan matches the scalar one");
+        }
+#endif
+    }
+}
+
+bool exceedsLimit(const std::string& text, const OTMLParseOptions& options)
+{
+    try {
+        parseText(text, options);
+    } catch(OTMLLimitException&) {
+        return true;
+    }
+    return false;
+}
+
+void testLimits()
+{
+    std::string text = "a\n  b\n    c: [1, 2, 3]\nd: 4\n";
+    OTMLParseOptions options;
+    options.maxBytes = text.length();
+    check(!exceedsLimit(text, options), "input at the maximum size");
+    options.maxBytes = text.length() - 1;
+    check(exceedsLimit(text, options), "input above the maximum size");
+
+    options = OTMLParseOptions();
+    options.maxLineLength = 16;
+    check(!exceedsLimit(text, options), "lines at the maximum length");
+    options.maxLineLength = 15;
+    check(exceedsLimit(text, options), "line above the maximum length");
+
+    // the top level counts as one level, so a, b and c need a maxDepth of 3
+    options = OTMLParseOptions();
+    options.maxDepth = 3;
+    check(!exceedsLimit(text, options), "nesting at the maximum depth");
+    options.maxDepth = 2;
+    check(exceedsLimit(text, options), "nesting above the maximum depth");
+    options.maxDepth = 1;
+    check(!exceedsLimit("a: 1\nb: 2\n", options), "top level only at depth 1");
+
+    // list items count as nodes, a, b, c, its 3 items and d make 7
+    options = OTMLParseOptions();
+    options.maxNodes = 7;
+    check(!exceedsLimit(text, options), "nodes at the maximum count");
+    options.maxNodes = 6;
+    check(exceedsLimit(text, options), "nodes above the maximum count");
+
+    options = OTMLParseOptions();
+    options.maxListLength = 3;
+    check(!exceedsLimit(text, options), "list at the maximum length");
+    options.maxListLength = 2;
+    check(exceedsLimit(text, options), "list above the maximum length");
+}
+
+#ifdef OTML_USE_PMR
+class CountingResource : public std::pmr::memory_resource {
+public:
+    CountingResource() : allocated(0), outstanding(0) { }
+
+    std::size_t allocated;
+    std::size_t outstanding;
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) {
+        allocated += bytes;
+        outstanding += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) {
+        outstanding -= bytes;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept { return this == &other; }
+};
+
+void testMemoryResource()
+{
+    CountingResource resource;
+    OTMLParseOptions options;
+    options.memoryResource = &resource;
+    OTMLDocumentPtr doc = parseText("a\n  b: a value long enough to leave the small string buffer\nc: [1, 2]\n", options);
+    check(resource.allocated > 0, "parsed document allocates from the given resource");
+    check(doc->memoryResource() == &resource && doc->at("a")->at("b")->memoryResource() == &resource &&
+          doc->at("c")->atIndex(1)->memoryResource() == &resource, "parsed nodes use the given resource");
+    doc->at("a")->writeAt("d", 5);
+    check(doc->at("a")->at("d")->memoryResource() == &resource, "nodes written later use the document resource");
+    doc.reset();
+    check(resource.outstanding == 0, "document releases everything it allocated");
+}
+#endif
+
+bool acceptsImage(const std::string& image)
+{
+    try {
+        OTMLSharedDocument::fromImage(image.data(), image.length());
+    } catch(OTMLException&) {
+        return false;
+    }
+    return true;
+}
+
+std::string corruptNode(const std::string& image, int index, int field, boost::uint64_t value)
+{
+    std::string corrupted = image;
+    std::size_t offset = sizeof(OTMLSharedHeader) + index * sizeof(OTMLSharedNodeData);
+    OTMLSharedNodeData node;
+    std::memcpy(&node, &corrupted[offset], sizeof(node));
+    switch(field) {
+    case 0: node.firstChild = value; break;
+    case 1: node.childCount = value; break;
+    case 2: node.tag = value; break;
+    case 3: node.valueLength = value; break;
+    case 4: node.sourceFile = value; break;
+    }
+    std::memcpy(&corrupted[offset], &node, sizeof(node));
+    return corrupted;
+}
+
+void testSharedImage()
+{
+    OTMLDocumentPtr doc = parseText("a\n  b: 1\n  c: 2\nd: 3\n");
+    std::string image = OTMLSharedDocument::createImage(doc);
+    check(acceptsImage(image), "image from createImage is accepted");
+    check(OTMLSharedDocument::fromImage(image.data(), image.length())->root().at("a").valueAt<int>("c") == 2, "image reads back");
+
+    // node 0 is the root with children a and d, a has b and c as nodes 3 and 4
+    check(!acceptsImage(corruptNode(image, 0, 1, 5)), "child range past the node count is rejected");
+    check(!acceptsImage(corruptNode(image, 1, 0, 0)), "child range pointing back at a parent is rejected");
+    check(!acceptsImage(corruptNode(image, 1, 0, 0xffffffffu)), "overflowing child range is rejected");
+    check(!acceptsImage(corruptNode(image, 3, 2, image.length())), "tag past the strings is rejected");
+    check(!acceptsImage(corruptNode(image, 3, 3, 0xffffffffu)), "value running past the strings is rejected");
+    check(!acceptsImage(corruptNode(image, 4, 4, (boost::uint64_t)1 << 40)), "source file past the strings is rejected");
+    check(!acceptsImage(image.substr(0, image.length() - 1)), "truncated image is rejected");
+}
+
+#ifdef OTML_COROUTINES
+void testStream()
+{
+    std::string text = "a: 1\n// comment\nb\n  c: 2\n  d: |\n    x\n    y\na: 3\nlist: [1, 2]";
+    std::istringstream in(text);
+    std::vector<OTMLNodePtr> nodes;
+    for(const OTMLNodePtr& node : OTMLDocument::stream(in, "stream.otml"))
+        nodes.push_back(node);
+    check(nodes.size() == 4, "stream yields every top level node");
+    if(nodes.size() != 4)
+        return;
+    check(nodes[0]->tag() == "a" && nodes[0]->value<int>() == 1 && nodes[2]->tag() == "a" && nodes[2]->value<int>() == 3,
+          "unique top level tags are yielded separately");
+    check(nodes[1]->valueAt<int>("c") == 2 && nodes[1]->valueAt<std::string>("d") == "x\ny\n", "streamed children");
+    check(nodes[3]->size() == 2 && nodes[3]->valueAtIndex<int>(1) == 2, "streamed list");
+    check(nodes[1]->sourceLine() == 3 && nodes[2]->sourceLine() == 8 && nodes[1]->at("d")->sourceLine() == 5 &&
+          nodes[2]->source() == "stream.otml:8", "streamed nodes keep their source lines");
+
+    // the same nodes come out of a shared buffer
+    std::size_t count = 0;
+    bool same = true;
+    for(const OTMLNodePtr& node : OTMLDocument::stream(OTMLStringPtr(new std::string(text)), "stream.otml"))
+        same = same && count < nodes.size() && node->emit() == nodes[count++]->emit();
+    check(same && count == nodes.size(), "streaming a buffer matches streaming a stream");
+
+    // limits apply to each top level node on its own
+    OTMLParseOptions options;
+    options.maxNodes = 3;
+    std::istringstream limited(text);
+    count = 0;
+    for(const OTMLNodePtr& node : OTMLDocument::stream(limited, "stream.otml", options))
+        count += node ? 1 : 0;
+    check(count == 4, "node limit applies per top level node");
+}
+#endif
+
+#ifdef OTML_PARALLEL
+void testParallel()
+{
+    std::stringstream text;
+    for(int i = 0; i < 64; ++i) {
+        text << "group" << i << "\n";
+        for(int j = 0; j < 40; ++j)
+            text << "  item" << j << ": " << i * j << "\n    size: [" << i << ", " << j << "]\n";
+    }
+    OTMLDocumentPtr doc = parseText(text.str());
+
+    // a small threshold and few threads, so groups nest and threads steal from each other
+    OTMLTaskPool pool(3);
+    for(std::size_t threshold = 1; threshold <= 4096; threshold *= 16) {
+        OTMLNodePtr copy = OTMLParallel::clone(doc, pool, threshold);
+        check(copy != doc && OTMLEmitter::emitNode(copy) == OTMLEmitter::emitNode(doc) && copy->hash() == doc->hash(), "parallel clone matches the original");
+        check(OTMLParallel::hash(doc, pool, threshold) == doc->hash(), "parallel hash matches the serial one");
+    }
+
+    // the first exception thrown by a task comes out of the group
+    bool thrown = false;
+    try {
+        OTMLParallel::reduce<int>(doc, [](const OTMLNodePtr& node, std::vector<int>&) -> int {
+            if(node->tag() == "item7")
+                throw OTMLException("failed");
+            return 0;
+        }, pool, 1);
+    } catch(OTMLException&) {
+        thrown = true;
+    }
+    check(thrown, "parallel reduce rethrows task exceptions");
+}
+#endif
+
+void testColumns()
+{
+    OTMLColumns columns;
+    columns.addColumn("name", OTMLColumn::StringColumn);
+    columns.addColumn("count", OTMLColumn::IntColumn);
+    columns.addColumn("ratio", OTMLColumn::DoubleColumn);
+    columns.extract(parseText("list\n  -\n    name: a\n    count: 1\n    ratio: 0.5\n")->at("list"));
+
+    // name converts and interns a new string before count fails
+    bool thrown = false;
+    try {
+        columns.extract(parseText("list\n  -\n    ratio: 2\n    name: b\n    count: many\n")->at("list"));
+    } catch(OTMLException&) {
+        thrown = true;
+    }
+    check(thrown, "failed conversion throws");
+    check(columns.rows() == 1 && columns.column("name").size() == 1 && columns.column("count").size() == 1 &&
+          columns.column("ratio").size() == 1, "failed record leaves no row behind");
+    check(columns.column("name").strings().size() == 2, "failed record leaves no interned string behind");
+
+    columns.extract(parseText("list\n  -\n    name: c\n    count: 3\n")->at("list"));
+    const OTMLColumn& name = columns.column("name");
+    const OTMLColumn& ratio = columns.column("ratio");
+    check(columns.rows() == 2 && name.string(1) == "c" && name.strings().size() == 3 &&
+          columns.column("count").ints()[1] == 3, "record after a failed one extracts");
+    check(ratio.has(0) && !ratio.has(1) && ratio.doubles()[1] == 0, "failed record leaves no presence behind");
+}
+
+boost::uint64_t xorshift(boost::uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+template<typename T, typename Bits>
+bool readsBackExactly(const OTMLNodePtr& node, T value)
+{
+    node->write(value);
+    T read = node->value<T>();
+    Bits bits, readBits;
+    std::memcpy(&bits, &value, sizeof(value));
+    std::memcpy(&readBits, &read, sizeof(read));
+    return bits == readBits;
+}
+
+template<typename T, typename Bits>
+void testFloatRoundTrip(int count, const char* name)
+{
+    OTMLNodePtr node = OTMLNode::create("value");
+    const T special[] = { T(0), -T(0), T(1) / 3, T(0.1), std::numeric_limits<T>::denorm_min(), -std::numeric_limits<T>::denorm_min(),
+                          std::numeric_limits<T>::min(), std::numeric_limits<T>::max(), -std::numeric_limits<T>::max(),
+                          std::numeric_limits<T>::epsilon(), std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity() };
+    bool exact = true;
+    for(std::size_t i = 0; i < sizeof(special) / sizeof(special[0]); ++i)
+        exact = readsBackExactly<T, Bits>(node, special[i]) && exact;
+    check(exact, std::string(name) + " special values read back bit for bit");
+
+    // every other bit pattern that is not a NaN, whose payload is not kept
+    boost::uint64_t state = 88172645463325252ULL;
+    int mismatches = 0;
+    for(int i = 0; i < count; ++i) {
+        Bits bits = (Bits)xorshift(state);
+        T value;
+        std::memcpy(&value, &bits, sizeof(value));
+        if(value == value && !readsBackExactly<T, Bits>(node, value))
+            mismatches++;
+    }
+    check(mismatches == 0, std::string(name) + " random bit patterns read back bit for bit");
+}
+
+bool rejectsPath(const OTMLNodePtr& root, const std::string& path)
+{
+    try {
+        root->writeAtPath(path, 1);
+    } catch(OTMLException&) {
+        return true;
+    }
+    return false;
+}
+
+void testPathWrites()
+{
+    OTMLDocumentPtr doc = parseText("a\n  b: 1\n  c: 2\n    d: 3\n  e: ~\n");
+    doc->writeAtPath("x/y/z", 4);
+    check(doc->at("x")->at("y")->valueAt<int>("z") == 4, "path write creates the intermediate nodes");
+
+    OTMLNodePtr c = doc->at("a")->at("c");
+    doc->writeAtPath("a/c", 5);
+    check(doc->at("a")->at("c") == c && c->value<int>() == 5 && c->valueAt<int>("d") == 3, "path write keeps the node and its children");
+
+    doc->writeAtPath("a/e", 6);
+    check(doc->at("a")->size() == 3 && doc->at("a")->valueAt<int>("e") == 6, "path write replaces a null node");
+
+    std::string before = doc->emit();
+    bool rejected = rejectsPath(doc, "") && rejectsPath(doc, "/a") && rejectsPath(doc, "a/") && rejectsPath(doc, "a//f");
+    check(rejected && doc->emit() == before, "invalid paths throw without touching the tree");
+
+    OTMLPathWriter writer(doc);
+    writer.write("a/f/g", 7);
+    OTMLNodePtr f = doc->at("a")->at("f");
+    writer.write("a/f/h", 8);
+    check(writer.resolve("a/f/i")->parent() == f && f->size() == 3 && doc->at("a")->size() == 4, "path writer reuses the prefixes it resolved");
+    check(f->valueAt<int>("g") == 7 && f->valueAt<int>("h") == 8, "path writer writes the values");
+
+    // a replaced prefix is looked up again instead of writing into the detached node
+    doc->writeAt("a", 9);
+    writer.write("a/f/g", 10);
+    check(doc->at("a")->at("f") != f && doc->at("a")->at("f")->valueAt<int>("g") == 10, "path writer resolves a replaced prefix again");
+    doc->at("a")->at("f")->setTag("k");
+    writer.write("a/f/g", 11);
+    check(doc->at("a")->at("f")->valueAt<int>("g") == 11 && doc->at("a")->at("k")->valueAt<int>("g") == 10,
+          "path writer resolves a retagged prefix again");
+}
+
+void testBlockValues()
+{
+    std::string* text = new std::string("script: |\n  line one\n\n    indented\nkeep: |+\n  a\n\nstrip: |-\n  b\n\n");
+    OTMLStringPtr buffer(text);
+    OTMLDocumentPtr doc = OTMLDocument::create();
+    {
+        OTMLParser parser(doc, buffer);
+        parser.parse();
+    }
+    // values are taken out of the source, which is not kept alive by the document or its clones
+    OTMLNodePtr clone = doc->clone();
+    check(buffer.use_count() == 1, "block values do not keep the parsed source");
+    check(doc->valueAt<std::string>("script") == "line one\n\n  indented\n", "block value");
+    check(doc->valueAt<std::string>("keep") == "a\n\n", "kept block value");
+    check(doc->valueAt<std::string>("strip") == "b", "stripped block value");
+    check(clone->valueAt<std::string>("script") == doc->valueAt<std::string>("script"), "cloned block value");
+    check(parseText(doc->emit())->emit() == doc->emit(), "block values emitted as read");
+}
+
+void testQuotedValues()
+{
+    const char* values[] = { " C:\\new ", "~", "[a, b]", "\"quoted\"", " \"spaced\" ", "|", "|+",
+                             "tab\\t", "\\\\", "\\", "\"", "\t", "a: b", "plain" };
+    const int count = sizeof(values) / sizeof(values[0]);
+    OTMLDocumentPtr doc = OTMLDocument::create();
+    for(int i = 0; i < count; ++i)
+        doc->writeIn(values[i]);
+    OTMLDocumentPtr read = parseText(doc->emit());
+    check(read->size() == count, "quoted values count");
+    for(int i = 0; i < count && i < read->size(); ++i) {
+        check(!read->atIndex(i)->isNull() && read->atIndex(i)->size() == 0, std::string("quoted value kind: ") + values[i]);
+        check(read->atIndex(i)->value<std::string>() == values[i], std::string("quoted value: ") + values[i]);
+        check(doc->atIndex(i)->value<std::string>() == values[i], std::string("written value: ") + values[i]);
+    }
+
+    // values quoted in the source are emitted as they were read
+    std::string text = "a: \"hello world\"\nb: \" x \"\nc: \"C:\\\\new\"\n";
+    check(parseText(text)->emit() == text, "quoted source values emitted unchanged");
+    check(parseText(text)->valueAt<std::string>("c") == "C:\\new", "escaped backslash before n");
+}
+
+void testOverlay()
+{
+    OTMLDocumentPtr base = parseText("Widget\n  size: 10\n  margin:\n    top: 1\n    left: 2\nLabel: ~\n");
+    OTMLDocumentPtr overrides = parseText("Widget:\n  margin:\n    top: 5\n  color: red\nLabel: text\n");
+
+    // a unique node added over one with the same tag merges their children
+    OTMLNodePtr merged = base->clone();
+    for(int i = 0; i < overrides->size(); ++i)
+        merged->addChild(overrides->atIndex(i)->clone());
+    check(merged->at("Widget")->valueAt<int>("size") == 10, "merge keeps children of the replaced node");
+    check(merged->at("Widget")->at("margin")->valueAt<int>("left") == 2, "merge keeps nested children");
+    check(merged->at("Widget")->at("margin")->valueAt<int>("top") == 5, "merge overrides nested values");
+    check(merged->at("Widget")->isUnique(), "merged node stays unique");
+
+    OTMLOverlayPtr overlay = OTMLOverlay::create();
+    overlay->addLayer(base);
+    overlay->addLayer(overrides);
+    check(overlay->materialize()->emit() == merged->emit(), "overlay matches merged layers");
+}
+
+void testPathViews()
+{
+    OTMLDocumentPtr doc = parseText("a\n  b: 1\n  c: 2\n");
+    {
+        OTMLPathView first(doc);
+        check(first.valueAt<int>("a/b") == 1, "first path view");
+    }
+
+    // views over the same tree are independent of each other
+    OTMLPathView second(doc);
+    check(second.get("a/b") && second.size() == 4, "second path view after the first was destroyed");
+    OTMLPathView third(doc);
+    third.refresh();
+    doc->at("a")->at("b")->write(5);
+    doc->at("a")->writeAt("d", 4);
+    third.refresh();
+    check(second.valueAt<int>("a/b") == 5 && second.valueAt<int>("a/d") == 4, "path view sees changes another view indexed");
+    check(third.valueAt<int>("a/b") == 5 && third.size() == 5, "path view after its own refresh");
+    doc->at("a")->removeChild(doc->at("a")->at("c"));
+    check(!third.get("a/c") && !second.get("a/c"), "path views drop removed children");
+
+    // changes are found through the nodes a view indexed, whichever tree was refreshed last
+    OTMLDocumentPtr other = parseText("x\n  y\n    z: 1\n    n: ~\n");
+    OTMLPathView otherView(other);
+    OTMLPathView sub(doc->at("a"));
+    check(otherView.valueAt<int>("x/y/z") == 1 && sub.valueAt<int>("b") == 5, "path views over other trees");
+    other->at("x")->at("y")->writeAt("w", 2);
+    third.refresh();
+    other->at("x")->at("y")->at("w")->setTag("v");
+    doc->at("a")->writeAt("e", 6);
+    check(otherView.valueAt<int>("x/y/v") == 2 && !otherView.get("x/y/w"), "path view after another tree was refreshed");
+    // a null node was never indexed, its parent still has to be
+    OTMLNodePtr hidden = other->at("x")->at("y")->atIndex(1);
+    hidden->setValue("3");
+    otherView.refresh();
+    hidden->setNull(false);
+    check(!!otherView.get("x/y/n"), "path view sees a node that is no longer null");
+    check(sub.valueAt<int>("e") == 6 && third.valueAt<int>("a/e") == 6 && second.valueAt<int>("a/e") == 6,
+          "path view over a subtree");
+}
+
+bool fileExists(const std::string& filename)
+{
+    return std::ifstream(filename.c_str()).good();
+}
+
+std::string shardFile(const std::string& manifest, const std::string& index)
+{
+    std::size_t dot = manifest.find_last_of('.');
+    return manifest.substr(0, dot) + "." + index + manifest.substr(dot);
+}
+
+void testShardedSave(const std::string& manifest)
+{
+    OTMLDocumentPtr doc = parseText("a: 1\nb: 2\nc: 3\n");
+    check(OTMLShardedDocument::save(doc, manifest), "sharded save");
+    check(fileExists(shardFile(manifest, "0")) && fileExists(shardFile(manifest, "2")), "sharded save writes a file per shard");
+
+    // a changed shard goes to the file the manifest on disk does not list
+    doc->at("a")->write(10);
+    check(OTMLShardedDocument::save(doc, manifest), "sharded save after a change");
+    check(fileExists(shardFile(manifest, "0b")) && !fileExists(shardFile(manifest, "0")) && fileExists(shardFile(manifest, "1")),
+          "changed shard alternates its file");
+    check(OTMLShardedDocument::open(manifest)->valueAt<int>("a") == 10, "sharded document reads the changed shard");
+
+    OTMLShardedDocumentPtr sharded = OTMLShardedDocument::open(manifest);
+    sharded->at("b")->write(20);
+    check(sharded->save() && OTMLShardedDocument::open(manifest)->valueAt<int>("b") == 20, "sharded document saves its loaded shards");
+    check(fileExists(shardFile(manifest, "1b")) && !fileExists(shardFile(manifest, "1")), "loaded shard alternates its file");
+
+    // fewer shards than before leave no files behind, files the manifest never listed are kept
+    std::ofstream unlisted(shardFile(manifest, "1").c_str());
+    unlisted << "z: 1\n";
+    unlisted.close();
+    doc->removeChild(doc->at("c"));
+    doc->removeChild(doc->at("b"));
+    check(OTMLShardedDocument::save(doc, manifest), "sharded save with fewer shards");
+    check(!fileExists(shardFile(manifest, "1b")) && !fileExists(shardFile(manifest, "2")) && !fileExists(manifest + ".tmp"),
+          "stale shards removed");
+    check(fileExists(shardFile(manifest, "1")), "files the manifest did not list are kept");
+    std::remove(shardFile(manifest, "1").c_str());
+    check(OTMLShardedDocument::open(manifest)->size() == 1, "sharded document after shrinking");
+}
+
+void testPatchLog()
+{
+    const std::string text = "a\n  b: 1\n  c: 2\nd: x\ne\n  f: 3\n  g: 4\n";
+    OTMLDocumentPtr master = parseText(text);
+    OTMLDocumentPtr replica = parseText(text);
+    OTMLPatchLog log(master);
+
+    master->at("a")->at("b")->write(10);
+    master->at("a")->writeAt("h", "new value");
+    master->at("a")->removeChild(master->at("a")->at("c"));
+    master->at("d")->setTag("renamed");
+    master->at("renamed")->setNull(true);
+    master->at("e")->clear();
+    OTMLNodePtr added = OTMLNode::create("added");
+    added->writeAt("x", 1);
+    added->writeAt("y", "two words");
+    master->addChild(added);
+    added->at("x")->write(2);
+
+    OTMLPatchLog::apply(replica, log.take());
+    check(replica->emit() == master->emit(), "replica matches master after mixed edits");
+    check(log.data().empty(), "patch log empty after take");
+}
+
+class RecordingObserver : public OTMLObserver {
+public:
+    RecordingObserver() : calls(0) { }
+    virtual void onChanges(const OTMLChangeSet& changes) { calls++; last = changes; }
+    int calls;
+    OTMLChangeSet last;
+};
+
+void testObservers()
+{
+    OTMLDocumentPtr doc = parseText("a\n  b: 1\n");
+    OTMLNodePtr a = doc->at("a");
+    OTMLObservers observers(doc);
+    RecordingObserver own, subtree;
+    observers.subscribe(a, &own);
+    observers.subscribe(a, &subtree, true);
+
+    // only subtree observers see changes below the node they watch
+    a->at("b")->write(2);
+    check(own.calls == 0, "own-node observer ignores descendant changes");
+    check(subtree.calls == 1 && subtree.last.size() == 1 && subtree.last[0].node == a->at("b") && subtree.last[0].valueChanged, "subtree observer sees descendant changes");
+    a->write(3);
+    check(own.calls == 1 && own.last.size() == 1 && own.last[0].node == a && own.last[0].valueChanged, "own-node observer sees its node");
+
+    // a child added and removed in the same batch cancels out
+    observers.beginBatch();
+    OTMLNodePtr c = OTMLNode::create("c", "x");
+    a->addChild(c);
+    a->removeChild(c);
+    a->setTag("renamed");
+    observers.endBatch();
+    check(own.calls == 2 && own.last.size() == 1, "batched changes delivered once");
+    check(own.last.size() == 1 && own.last[0].added.empty() && own.last[0].removed.empty() && own.last[0].tagChanged, "add and remove in a batch cancel");
+
+    observers.unsubscribe(a, &own);
+    a->write(4);
+    check(own.calls == 2 && subtree.calls == 4, "unsubscribed observer not notified");
+}
+
+void testTransactions()
+{
+    const std::string text = "a: 1\nb: 2\nc\n  d: 3\n";
+    OTMLDocumentPtr doc = parseText(text);
+    OTMLDocumentPtr replica = parseText(text);
+    OTMLPatchLog log(doc);
+
+    // children taken out and put back inside a transaction carry the changes made meanwhile
+    OTMLNodePtr b = doc->at("b");
+    OTMLNodePtr c = doc->at("c");
+    doc->beginTransaction();
+    doc->removeChild(b);
+    b->write(42);
+    doc->addChild(b);
+    doc->removeChild(c);
+    c->setUnique(true);
+    c->at("d")->write(4);
+    doc->addChild(c);
+    doc->commitTransaction();
+    OTMLPatchLog::apply(replica, log.take());
+    check(replica->emit() == doc->emit() && replica->valueAt<int>("b") == 42, "replica after children were put back");
+    check(replica->at("c")->isUnique() && replica->at("c")->valueAt<int>("d") == 4, "replica keeps changes made to a detached child");
+
+    // rollback undoes them as well
+    const std::string committed = doc->emit();
+    doc->beginTransaction();
+    doc->clear();
+    b->write(7);
+    c->setUnique(false);
+    c->at("d")->write(5);
+    doc->addChild(c);
+    doc->rollbackTransaction();
+    check(doc->emit() == committed && b->parent() == doc, "rollback restores detached children");
+    check(c->isUnique() && c->valueAt<int>("d") == 4, "rollback restores changes made to detached children");
+}
+
 int main(int argc, char** argv)
 {
     testWrite("test.otml");
     testRead("test.otml");
-    return 0;
+    testEmitCache();
+    testStreamRecords();
+    testScanLines();
+    testLimits();
+#ifdef OTML_USE_PMR
+    testMemoryResource();
+#endif
+    testSharedImage();
+#ifdef OTML_COROUTINES
+    testStream();
+#endif
+#ifdef OTML_PARALLEL
+    testParallel();
+#endif
+    testColumns();
+    testFloatRoundTrip<double, boost::uint64_t>(2000000, "double");
+    testFloatRoundTrip<float, boost::uint32_t>(2000000, "float");
+    testPathWrites();
+    testBlockValues();
+    testQuotedValues();
+    testOverlay();
+    testPathViews();
+    testSaveIfChanged("changed.otml");
+    testSaveAppend("append.otml");
+    testShardedSave("shards.otml");
+    testPatchLog();
+    testObservers();
+    testTransactions();
+    return failures ? 1 : 0;
 }